@@ -0,0 +1,262 @@
+// Support shared by re_to_dfa, dfa_to_re and dfa_minim: FlatDFA and the metrics macros. Include
+// it after api.hpp, which declares DFA and Alphabet.
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Instrumentation, compiled in with -DFLA_METRICS and absent otherwise: FLA_PHASE times the rest
+// of the enclosing scope, FLA_COUNT adds to a counter and FLA_PEAK keeps the largest value seen.
+// Without the flag the macros expand to nothing and their arguments are never evaluated.
+// metrics_json() reports everything recorded; with set_tracing(true) the phases are also kept as
+// Chrome trace events for write_chrome_trace() (chrome://tracing or Perfetto).
+#ifdef FLA_METRICS
+class Metrics {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    static Metrics &global() {
+        static Metrics metrics;
+        return metrics;
+    }
+
+    void add(const char *name, uint64_t n) {
+        std::lock_guard<std::mutex> lock(mutex);
+        counters[name] += n;
+    }
+
+    void peak(const char *name, uint64_t value) {
+        std::lock_guard<std::mutex> lock(mutex);
+        uint64_t &current = peaks[name];
+        current = std::max(current, value);
+    }
+
+    void phase(const char *name, Clock::time_point start, Clock::time_point end) {
+        std::lock_guard<std::mutex> lock(mutex);
+        PhaseTotal &total = phases[name];
+        total.calls++;
+        total.ns += uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+        if (tracing) {
+            const auto thread = threads.emplace(std::this_thread::get_id(), threads.size()).first->second;
+            events.push_back({name, micros(start - epoch), micros(end - start), thread});
+        }
+    }
+
+    void set_tracing(bool on) {
+        std::lock_guard<std::mutex> lock(mutex);
+        tracing = on;
+    }
+
+    void reset() {
+        std::lock_guard<std::mutex> lock(mutex);
+        counters.clear();
+        peaks.clear();
+        phases.clear();
+        events.clear();
+    }
+
+    std::string to_json() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::ostringstream out;
+        out << "{\"phases\": {";
+        const char *separator = "";
+        for (const auto &entry: phases) {
+            out << separator << "\"" << entry.first << "\": {\"calls\": " << entry.second.calls
+                << ", \"ms\": " << double(entry.second.ns) / 1e6 << "}";
+            separator = ", ";
+        }
+        out << "}, \"counters\": " << values_json(counters) << ", \"peaks\": " << values_json(peaks) << "}";
+        return out.str();
+    }
+
+    bool write_trace(const std::string &path) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::ofstream out(path);
+        out << "{\"traceEvents\": [";
+        for (size_t i = 0; i < events.size(); i++) {
+            out << (i ? ",\n" : "\n") << "{\"name\": \"" << events[i].name << "\", \"ph\": \"X\", \"ts\": "
+                << events[i].start_us << ", \"dur\": " << events[i].duration_us << ", \"pid\": 1, \"tid\": "
+                << events[i].thread << "}";
+        }
+        out << "\n]}\n";
+        return bool(out);
+    }
+
+private:
+    struct PhaseTotal {
+        uint64_t calls = 0;
+        uint64_t ns = 0;
+    };
+
+    struct TraceEvent {
+        const char *name;
+        double start_us;
+        double duration_us;
+        size_t thread;
+    };
+
+    static double micros(Clock::duration d) {
+        return std::chrono::duration<double, std::micro>(d).count();
+    }
+
+    static std::string values_json(const std::map<std::string, uint64_t> &values) {
+        std::ostringstream out;
+        out << "{";
+        const char *separator = "";
+        for (const auto &entry: values) {
+            out << separator << "\"" << entry.first << "\": " << entry.second;
+            separator = ", ";
+        }
+        out << "}";
+        return out.str();
+    }
+
+    std::mutex mutex;
+    std::map<std::string, uint64_t> counters;
+    std::map<std::string, uint64_t> peaks;
+    std::map<std::string, PhaseTotal> phases;
+    bool tracing = false;
+    std::vector<TraceEvent> events;
+    std::map<std::thread::id, size_t> threads;
+    const Clock::time_point epoch = Clock::now();
+};
+
+class PhaseTimer {
+public:
+    explicit PhaseTimer(const char *init_name) : name(init_name), start(Metrics::Clock::now()) {}
+
+    ~PhaseTimer() {
+        Metrics::global().phase(name, start, Metrics::Clock::now());
+    }
+
+private:
+    const char *name;
+    Metrics::Clock::time_point start;
+};
+
+#define FLA_JOIN_(a, b) a##b
+#define FLA_JOIN(a, b) FLA_JOIN_(a, b)
+#define FLA_PHASE(name) PhaseTimer FLA_JOIN(fla_phase_, __LINE__)(name)
+#define FLA_COUNT(name, n) Metrics::global().add(name, uint64_t(n))
+#define FLA_PEAK(name, value) Metrics::global().peak(name, uint64_t(value))
+
+inline std::string metrics_json() {
+    return Metrics::global().to_json();
+}
+
+inline void reset_metrics() {
+    Metrics::global().reset();
+}
+
+inline void set_tracing(bool on) {
+    Metrics::global().set_tracing(on);
+}
+
+inline bool write_chrome_trace(const std::string &path) {
+    return Metrics::global().write_trace(path);
+}
+#else
+#define FLA_PHASE(name) do {} while (0)
+#define FLA_COUNT(name, n) do {} while (0)
+#define FLA_PEAK(name, value) do {} while (0)
+
+inline std::string metrics_json() {
+    return "{}";
+}
+
+inline void reset_metrics() {}
+
+inline void set_tracing(bool) {}
+
+inline bool write_chrome_trace(const std::string &) {
+    return false;
+}
+#endif
+
+// Integer-indexed automaton: states are 0..size()-1 and `trans` is a flat size()×|alphabet|
+// table with NONE for a missing transition. The api DFA is only touched in from_api/to_api.
+struct FlatDFA {
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    std::string alphabet;
+    std::vector<uint32_t> trans;
+    std::vector<bool> final;
+    std::vector<std::string> names;
+    uint32_t initial = NONE;
+
+    FlatDFA() = default;
+
+    explicit FlatDFA(const std::string &init_alphabet) : alphabet(init_alphabet) {}
+
+    size_t size() const {
+        return final.size();
+    }
+
+    size_t width() const {
+        return alphabet.size();
+    }
+
+    uint32_t add_state(const std::string &name, bool is_final) {
+        names.push_back(name);
+        final.push_back(is_final);
+        trans.resize(trans.size() + width(), NONE);
+        return uint32_t(size() - 1);
+    }
+
+    uint32_t get_trans(uint32_t state, size_t a) const {
+        return trans[state * width() + a];
+    }
+
+    void set_trans(uint32_t state, size_t a, uint32_t to) {
+        trans[state * width() + a] = to;
+    }
+
+    // states are numbered in name order
+    static FlatDFA from_api(const DFA &dfa) {
+        FlatDFA flat(dfa.get_alphabet().to_string());
+        const auto final_states = dfa.get_final_states();
+        std::unordered_map<std::string, uint32_t> ids;
+        for (const auto &state: dfa.get_states()) {
+            ids[state] = flat.add_state(state, final_states.find(state) != final_states.end());
+        }
+        for (uint32_t s = 0; s < flat.size(); s++) {
+            for (size_t a = 0; a < flat.width(); a++) {
+                if (dfa.has_trans(flat.names[s], flat.alphabet[a])) {
+                    flat.set_trans(s, a, ids.at(dfa.get_trans(flat.names[s], flat.alphabet[a])));
+                }
+            }
+        }
+        const auto it = ids.find(dfa.get_initial_state());
+        if (it != ids.end()) {
+            flat.initial = it->second;
+        }
+        return flat;
+    }
+
+    DFA to_api() const {
+        DFA dfa = DFA(Alphabet(alphabet));
+        for (size_t s = 0; s < size(); s++) {
+            dfa.create_state(names[s], final[s]);
+        }
+        for (uint32_t s = 0; s < size(); s++) {
+            for (size_t a = 0; a < width(); a++) {
+                const uint32_t to = get_trans(s, a);
+                if (to != NONE) {
+                    dfa.set_trans(names[s], alphabet[a], names[to]);
+                }
+            }
+        }
+        if (initial != NONE) {
+            dfa.set_initial(names[initial]);
+        }
+        return dfa;
+    }
+};
@@ -0,0 +1,340 @@
+// Stage benchmark for dfa_minim. Build it next to task.cpp, against the same api.hpp:
+//
+//   g++ -std=c++17 -O2 -pthread bench.cpp -o bench
+//   ./bench [--sizes 10,1000,...] [--generators random,chain,...] [--engines hopcroft,...]
+//           [--alphabet 2] [--seed 1] [--threads 0] [--timeout 60]
+//
+// Prints a JSON array with one record per (generator, size, engine): wall time of every stage,
+// the minimised size and the peak RSS. Each case runs in a forked child, so the RSS is that of
+// the case alone, and a case still running after --timeout seconds is killed and reported with
+// "timed_out": true (the pairwise reference engine and Moore rounds on long chains are
+// quadratic).
+//
+// The incremental engine builds an IncrementalMinimizer, flips the final bit of q50 (or the
+// last state) and updates, flips it back and updates again, then repeats the pair ten times.
+// With the edit fixed, the updates should take about the same time whatever the size, as long
+// as few states reach q50 (chain, comb). On random automata most states do, and every update is
+// a rebuild costing about one hopcroft_classes run. Built with -DFLA_METRICS, the record also
+// carries the counters of the first pair (region size, signature lookups, walks, rebuilds).
+#include "task.cpp"
+#include "../common/fla.hpp"
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <csignal>
+#include <sstream>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+struct BenchConfig {
+    std::vector<size_t> sizes = {10, 100, 1000, 10000, 100000, 1000000};
+    std::vector<std::string> generators = {"random", "chain", "comb", "many_equivalent"};
+    std::vector<std::string> engines = {"valmari_lehtinen", "hopcroft", "parallel_moore", "reference", "incremental"};
+    size_t alphabet = 2;
+    uint64_t seed = 1;
+    size_t threads = 0;
+    unsigned timeout = 60;
+};
+
+std::string bench_alphabet(size_t size) {
+    const std::string symbols = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    return symbols.substr(0, std::max<size_t>(std::min(size, symbols.size()), 1));
+}
+
+// Every transition present, uniform targets, about a third of the states final.
+FlatDFA random_dfa(size_t n, const std::string &alphabet, std::mt19937_64 &rng) {
+    FlatDFA dfa(alphabet);
+    for (size_t s = 0; s < n; s++) {
+        dfa.add_state("q" + std::to_string(s), rng() % 3 == 0);
+    }
+    for (uint32_t s = 0; s < n; s++) {
+        for (size_t a = 0; a < alphabet.size(); a++) {
+            dfa.set_trans(s, a, uint32_t(rng() % n));
+        }
+    }
+    dfa.initial = 0;
+    return dfa;
+}
+
+// q0 -a-> q1 -a-> ... -a-> q(n-1), the last one final: already minimal, partial, n rounds of Moore.
+FlatDFA chain_dfa(size_t n, const std::string &alphabet, std::mt19937_64 &) {
+    FlatDFA dfa(alphabet);
+    for (size_t s = 0; s < n; s++) {
+        dfa.add_state("q" + std::to_string(s), s + 1 == n);
+    }
+    for (uint32_t s = 0; s + 1 < n; s++) {
+        dfa.set_trans(s, 0, s + 1);
+    }
+    dfa.initial = 0;
+    return dfa;
+}
+
+// A spine on the first symbol with a final tooth hanging off every spine state on the others.
+// A tooth leads back to the first spine state of its run of ten, so teeth come in groups of ten
+// equivalent states (one huge class would only measure the length of its joined name).
+FlatDFA comb_dfa(size_t n, const std::string &alphabet, std::mt19937_64 &) {
+    FlatDFA dfa(alphabet);
+    const size_t spine = std::max<size_t>(n / 2, 1);
+    for (size_t s = 0; s < spine; s++) {
+        dfa.add_state("q" + std::to_string(s), false);
+    }
+    for (size_t s = spine; s < n; s++) {
+        dfa.add_state("q" + std::to_string(s), true);
+    }
+    for (uint32_t s = 0; s < spine; s++) {
+        if (s + 1 < spine) {
+            dfa.set_trans(s, 0, s + 1);
+        }
+        if (spine + s < n) {
+            for (size_t a = 1; a < alphabet.size(); a++) {
+                dfa.set_trans(s, a, uint32_t(spine + s));
+            }
+            dfa.set_trans(uint32_t(spine + s), 0, s / 10 * 10);
+        }
+    }
+    dfa.initial = 0;
+    return dfa;
+}
+
+// Ten copies of a random core of n / 10 states, each transition going to the right core state
+// in a random copy, so the minimal DFA is at most the core.
+FlatDFA many_equivalent_dfa(size_t n, const std::string &alphabet, std::mt19937_64 &rng) {
+    const size_t copies = 10;
+    const size_t core_size = std::max<size_t>(n / copies, 1);
+    const FlatDFA core = random_dfa(core_size, alphabet, rng);
+    FlatDFA dfa(alphabet);
+    for (size_t s = 0; s < core_size * copies; s++) {
+        dfa.add_state("q" + std::to_string(s), core.final[s % core_size]);
+    }
+    for (uint32_t s = 0; s < dfa.size(); s++) {
+        for (size_t a = 0; a < alphabet.size(); a++) {
+            const uint32_t to = core.get_trans(uint32_t(s % core_size), a);
+            dfa.set_trans(s, a, uint32_t(to + core_size * (rng() % copies)));
+        }
+    }
+    dfa.initial = 0;
+    return dfa;
+}
+
+FlatDFA generate(const std::string &generator, size_t n, const std::string &alphabet, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    if (generator == "chain") {
+        return chain_dfa(n, alphabet, rng);
+    }
+    if (generator == "comb") {
+        return comb_dfa(n, alphabet, rng);
+    }
+    if (generator == "many_equivalent") {
+        return many_equivalent_dfa(n, alphabet, rng);
+    }
+    return random_dfa(n, alphabet, rng);
+}
+
+class StageTimer {
+public:
+    StageTimer() : last(std::chrono::steady_clock::now()) {}
+
+    void stage(const std::string &name) {
+        const auto now = std::chrono::steady_clock::now();
+        stages.emplace_back(name, std::chrono::duration<double, std::milli>(now - last).count());
+        last = now;
+    }
+
+    std::string to_json() const {
+        std::ostringstream out;
+        double total = 0;
+        out << "\"stages_ms\": {";
+        for (size_t i = 0; i < stages.size(); i++) {
+            out << (i ? ", " : "") << "\"" << stages[i].first << "\": " << stages[i].second;
+            total += stages[i].second;
+        }
+        out << "}, \"total_ms\": " << total;
+        return out.str();
+    }
+
+private:
+    std::chrono::steady_clock::time_point last;
+    std::vector<std::pair<std::string, double>> stages;
+};
+
+// One edit near the start of the automaton, applied and undone, each followed by update().
+// `metrics` gets the counters of the two updates.
+size_t run_incremental(const DFA &input, StageTimer &timer, std::string &metrics) {
+    const std::string edited = "q" + std::to_string(std::min<size_t>(50, input.get_states().size() - 1));
+    const bool was_final = input.is_final(edited);
+    timer.stage("pick_edit");
+    IncrementalMinimizer minimizer(input);
+    timer.stage("construct");
+    reset_metrics();
+    minimizer.set_final(edited, !was_final);
+    minimizer.update();
+    timer.stage("edit_update");
+    minimizer.set_final(edited, was_final);
+    minimizer.update();
+    timer.stage("revert_update");
+    metrics = metrics_json();
+    for (int i = 0; i < 10; i++) {
+        minimizer.set_final(edited, !was_final);
+        minimizer.update();
+        minimizer.set_final(edited, was_final);
+        minimizer.update();
+    }
+    timer.stage("ten_more_pairs");
+    const DFA result = minimizer.minimal();
+    timer.stage("minimal");
+    return result.get_states().size();
+}
+
+// The stages of dfa_minim for one engine, timed one by one; returns the minimised size.
+size_t run_engine(const std::string &engine, const DFA &input, size_t threads, StageTimer &timer) {
+    FlatDFA dfa = FlatDFA::from_api(input);
+    timer.stage("from_api");
+    dfa = trim(dfa);
+    timer.stage("trim");
+
+    if (engine == "reference") {
+        DFA d = dfa.to_api();
+        timer.stage("to_api");
+        if (d.get_states().empty()) {
+            return 0;
+        }
+        add_dead_state(d);
+        timer.stage("add_dead_state");
+        const auto pairs = get_state_equ_pairs(d);
+        timer.stage("get_state_equ_pairs");
+        const auto groups = merge_into_groups(pairs, d);
+        timer.stage("merge_into_groups");
+        auto minim_dfa = build_dfa(groups, d);
+        minim_dfa.delete_state(DEAD_NAME);
+        timer.stage("build_dfa");
+        return minim_dfa.get_states().size();
+    }
+
+    uint32_t dead = FlatDFA::NONE;
+    std::vector<uint32_t> class_of;
+    if (engine == "valmari_lehtinen") {
+        class_of = valmari_lehtinen_classes(dfa);
+    } else {
+        dead = add_dead_state(dfa);
+        timer.stage("add_dead_state");
+        class_of = engine == "parallel_moore" ? parallel_moore_classes(dfa, threads) : hopcroft_classes(dfa);
+    }
+    timer.stage("refine");
+    const FlatDFA minim_dfa = build_minimal(dfa, class_of, dead);
+    timer.stage("build_minimal");
+    const DFA result = minim_dfa.to_api();
+    timer.stage("to_api");
+    return result.get_states().size();
+}
+
+std::string run_case(const BenchConfig &config, const std::string &generator, size_t n, const std::string &engine) {
+    const std::string alphabet = bench_alphabet(config.alphabet);
+    const DFA input = generate(generator, n, alphabet, config.seed).to_api();
+    StageTimer timer;
+    std::string metrics;
+    const size_t minimised = engine == "incremental" ? run_incremental(input, timer, metrics)
+                                                     : run_engine(engine, input, config.threads, timer);
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    std::ostringstream out;
+    out << "  {\"generator\": \"" << generator << "\", \"states\": " << n << ", \"alphabet\": " << alphabet.size()
+        << ", \"seed\": " << config.seed << ", \"engine\": \"" << engine << "\", " << timer.to_json()
+        << ", \"minimized_states\": " << minimised << ", \"peak_rss_kb\": " << usage.ru_maxrss;
+    if (!metrics.empty()) {
+        out << ", \"update_metrics\": " << metrics;
+    }
+    out << "}";
+    return out.str();
+}
+
+// Runs the case in a child process and returns its record, or "" if the child failed.
+std::string run_isolated(const BenchConfig &config, const std::string &generator, size_t n, const std::string &engine) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return "";
+    }
+    const pid_t child = fork();
+    if (child == 0) {
+        close(fds[0]);
+        alarm(config.timeout);
+        const std::string record = run_case(config, generator, n, engine);
+        const bool written = write(fds[1], record.data(), record.size()) == ssize_t(record.size());
+        std::_Exit(written ? 0 : 1);
+    }
+    close(fds[1]);
+    std::string record;
+    char buffer[4096];
+    ssize_t got;
+    while ((got = read(fds[0], buffer, sizeof(buffer))) > 0) {
+        record.append(buffer, size_t(got));
+    }
+    close(fds[0]);
+    int status = 0;
+    waitpid(child, &status, 0);
+    if (child > 0 and WIFSIGNALED(status) and WTERMSIG(status) == SIGALRM) {
+        std::ostringstream out;
+        out << "  {\"generator\": \"" << generator << "\", \"states\": " << n << ", \"engine\": \"" << engine
+            << "\", \"timed_out\": true, \"timeout_s\": " << config.timeout << "}";
+        return out.str();
+    }
+    return child > 0 and WIFEXITED(status) and WEXITSTATUS(status) == 0 ? record : "";
+}
+
+template<class T, class F>
+std::vector<T> split_list(const std::string &list, const F &convert) {
+    std::vector<T> items;
+    std::stringstream in(list);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        if (!item.empty()) {
+            items.push_back(convert(item));
+        }
+    }
+    return items;
+}
+
+int main(int argc, char **argv) {
+    BenchConfig config;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        const std::string flag = argv[i];
+        const std::string value = argv[i + 1];
+        if (flag == "--sizes") {
+            config.sizes = split_list<size_t>(value, [](const std::string &s) { return size_t(std::stoull(s)); });
+        } else if (flag == "--generators") {
+            config.generators = split_list<std::string>(value, [](const std::string &s) { return s; });
+        } else if (flag == "--engines") {
+            config.engines = split_list<std::string>(value, [](const std::string &s) { return s; });
+        } else if (flag == "--alphabet") {
+            config.alphabet = std::stoul(value);
+        } else if (flag == "--seed") {
+            config.seed = std::stoull(value);
+        } else if (flag == "--threads") {
+            config.threads = std::stoul(value);
+        } else if (flag == "--timeout") {
+            config.timeout = unsigned(std::stoul(value));
+        } else {
+            std::fprintf(stderr, "unknown option %s\n", flag.c_str());
+            return 2;
+        }
+    }
+
+    std::printf("[\n");
+    bool first = true;
+    for (const auto &generator: config.generators) {
+        for (size_t n: config.sizes) {
+            for (const auto &engine: config.engines) {
+                const std::string record = run_isolated(config, generator, n, engine);
+                if (record.empty()) {
+                    std::fprintf(stderr, "%s/%zu/%s failed\n", generator.c_str(), n, engine.c_str());
+                    continue;
+                }
+                std::printf("%s%s", first ? "" : ",\n", record.c_str());
+                std::fflush(stdout);
+                first = false;
+            }
+        }
+    }
+    std::printf("\n]\n");
+    return 0;
+}
@@ -1,10 +1,14 @@
 #include "api.hpp"
+#include "../common/fla.hpp"
 #include <string>
 #include <vector>
 #include <iostream>
 #include <map>
-#include <fstream>
-#include <map>
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
 
 const std::string EPS = "@";
 const std::string DEAD_NAME = "?";
@@ -13,8 +17,6 @@ enum Equ {
     equ, not_equ, undefined
 };
 
-typedef std::map<std::string, std::map<std::string, std::vector<std::string>>> RawTransitionTable;
-typedef std::map<std::string, std::map<std::string, std::string>> TransitionTable;
 typedef std::map<std::string, std::map<std::string, Equ>> StateEquTable;
 typedef std::vector<std::set<std::string>> StateGroups;
 
@@ -28,129 +30,10 @@ bool is_in(const T &element, const std::vector<T> &container) {
     return std::count(container.begin(), container.end(), element) > 0;
 }
 
-template<typename T>
-std::set<T> get_union(const std::set<T> &a, const std::set<T> &b) {
-    std::set<T> result = a;
-    result.insert(b.begin(), b.end());
-    return result;
-}
-
-TransitionTable get_transition_table(const DFA &dfa) {
-    RawTransitionTable table;
-
-    auto states = dfa.get_states();
-
-    for (const auto &state: states) {
-        for (char sym: dfa.get_alphabet().to_string()) {
-            if (dfa.has_trans(state, sym)) {
-                std::string dst_state = dfa.get_trans(state, sym);
-                table[state][dst_state].push_back(std::string(1, sym));
-            }
-        }
-    }
-
-    TransitionTable res;
-    for (const auto &state_i: states) {
-        for (const auto &state_j: states) {
-            if (table[state_i][state_j].empty()) {
-                res[state_i][state_j] = "";
-            } else if (table[state_i][state_j].size() == 1) {
-                res[state_i][state_j] = table[state_i][state_j][0];
-            } else {
-                res[state_i][state_j] = table[state_i][state_j][0];
-                for (int i = 1; i < table[state_i][state_j].size(); i++) {
-                    res[state_i][state_j] += "|" + table[state_i][state_j][i];
-                }
-                res[state_i][state_j] = res[state_i][state_j];
-            }
-        }
-    }
-    return res;
-}
-
-struct MDFA {
-public:
-    explicit MDFA(const DFA &dfa) : api_dfa(dfa) {
-        transition_table = get_transition_table(dfa);
-        init_state = dfa.get_initial_state();
-        final_states = dfa.get_final_states();
-        active_states = dfa.get_states();
-    }
-
-    MDFA(const MDFA &mdfa, const std::string &final_state) : api_dfa(mdfa.api_dfa) {
-        transition_table = mdfa.transition_table;
-        init_state = mdfa.init_state;
-        final_states = {final_state};
-        active_states = mdfa.active_states;
-    }
-
-    //$ dot -Tsvg out.gv > out.svg
-    void to_graphviz(const std::string &path) {
-        std::ofstream outfile(path);
-        outfile << "digraph G {" << std::endl;
-        outfile << "{" << std::endl;
-        outfile << "node [style=filled fillcolor=yellow]" << std::endl;
-        outfile << init_state << " []" << std::endl;
-        outfile << "}" << std::endl;
-        outfile << "{" << std::endl;
-        outfile << "node []" << std::endl;
-        for (const auto &state: final_states) {
-            outfile << state << " [shape=doublecircle]" << std::endl;
-        }
-        outfile << "}" << std::endl;
-
-        for (const auto &state_i: active_states) {
-            for (const auto &state_j: active_states) {
-                if (transition_table[state_i][state_j] != "") {
-                    outfile << state_i << "->" << state_j << "[ label=\"" << transition_table[state_i][state_j]
-                            << "\"];"
-                            << std::endl;
-                }
-            }
-        }
-        outfile << "}" << std::endl;
-    }
-
-private:
-    const DFA api_dfa;
-    TransitionTable transition_table;
-    std::string init_state;
-    std::set<std::string> final_states;
-    std::set<std::string> active_states;
-};
-
-void print_state_equ_table(StateEquTable &state_equ_table, const DFA &dfa) {
-    return;
-    std::cout << "   ";
-    for (const auto &state_i: dfa.get_states()) {
-        std::cout << "    " << state_i;
-    }
-    std::cout << std::endl;
-
-    for (const auto &state_i: dfa.get_states()) {
-        std::cout << "  " << state_i;
-        for (const auto &state_j: dfa.get_states()) {
-            if (state_equ_table[state_i][state_j] == equ)
-                std::cout << "  equ";
-            else if (state_equ_table[state_i][state_j] == not_equ)
-                std::cout << " nequ";
-            else
-                std::cout << " unde";
-        }
-        std::cout << std::endl;
-    }
-}
-
-int k = 0;
-
-
 Equ check_equ(const std::string &state1, const std::string &state2, DFA &dfa, StateEquTable &state_equ_table, std::map<std::string, std::map<std::string, bool>> marked) {
-//    std::cout << state1 <<"  "<< state2 << std::endl;
-    print_state_equ_table(state_equ_table, dfa);
-    
+    // a pair already on the current path is assumed equivalent; that only holds if the whole
+    // walk finds no difference, so it is not cached
     if (marked[state1][state2] == true or marked[state2][state1] == true) {
-        state_equ_table[state1][state2] = equ;
-        state_equ_table[state2][state1] = equ;
         return equ;
     }
     marked[state1][state2] = true;
@@ -182,7 +65,7 @@ Equ check_equ(const std::string &state1, const std::string &state2, DFA &dfa, St
     }
     
     
-    k++;
+    FLA_COUNT("dfa_minim.pairs_compared", 1);
     
     for (char alph_sym: dfa.get_alphabet().to_string()) {
         auto trans1 = dfa.get_trans(state1, alph_sym);
@@ -197,17 +80,13 @@ Equ check_equ(const std::string &state1, const std::string &state2, DFA &dfa, St
             exit(1);
         }
     }
-    //
-
-    state_equ_table[state1][state2] = equ;
-    state_equ_table[state2][state1] = equ;
+    // equ here still rests on the path assumptions above, so only the top-level caller caches it
     return equ;
 }
 
-StateGroups get_state_equ_pairs(DFA &dfa) {
-    // add dead_station
+// Completes the DFA with DEAD_NAME as the target of every missing transition.
+void add_dead_state(DFA &dfa) {
     dfa.create_state(DEAD_NAME);
-    auto states = dfa.get_states();
     for (const auto &state: dfa.get_states()) {
         for (char alph_sym: dfa.get_alphabet().to_string()) {
             if (!dfa.has_trans(state, alph_sym)) {
@@ -215,24 +94,36 @@ StateGroups get_state_equ_pairs(DFA &dfa) {
             }
         }
     }
+}
 
+// Same for a FlatDFA: every missing transition goes to a new state DEAD_NAME, whose id is returned.
+uint32_t add_dead_state(FlatDFA &dfa) {
+    const uint32_t dead = dfa.add_state(DEAD_NAME, false);
+    for (auto &to: dfa.trans) {
+        if (to == FlatDFA::NONE) {
+            to = dead;
+        }
+    }
+    return dead;
+}
+
+// Pairwise reference: expects a DFA completed by add_dead_state.
+StateGroups get_state_equ_pairs(DFA &dfa) {
     StateEquTable state_equ_table;
-//    print_state_equ_table(state_equ_table, dfa);
 
     for (const auto &state_i: dfa.get_states()) {
         for (const auto &state_j: dfa.get_states()) {
             state_equ_table[state_i][state_j] = undefined;
         }
     }
-//    print_state_equ_table(state_equ_table, dfa);
 
 
 
     // check equ
     StateGroups pairs;
+    FLA_PHASE("dfa_minim.get_state_equ_pairs");
     for (const auto &state_i: dfa.get_states()) {
         for (const auto &state_j: dfa.get_states()) {
-//            std::cout << state_i << "  " << state_j << std::endl;
             std::map<std::string, std::map<std::string, bool>> marked;
 //            for (const auto &state_i: dfa.get_states()) {
 //                for (const auto &state_j: dfa.get_states()) {
@@ -240,213 +131,1618 @@ StateGroups get_state_equ_pairs(DFA &dfa) {
 //                }
 //            }
             if (state_i != state_j and check_equ(state_i, state_j, dfa, state_equ_table, marked)==equ){
+                state_equ_table[state_i][state_j] = equ;
+                state_equ_table[state_j][state_i] = equ;
                 if (not is_in({state_i, state_j}, pairs))
                     pairs.push_back({state_i, state_j});
             }
-//            print_state_equ_table(state_equ_table, dfa);
         }
     }
-    print_state_equ_table(state_equ_table, dfa);
     return pairs;
 }
 
-template<class T>
-bool has_disjoint(const T &conainer1, const T &conainer2){
-    for (const auto &elem: conainer1)
-        if (is_in(elem, conainer2))
-            return true;
-    return false;
+// Block partition of the states 0..n-1 for Hopcroft's algorithm. Each block is a contiguous
+// range of `elems`; marking a state moves it to the front of its block, and split() cuts the
+// marked prefix off into a new block.
+struct Partition {
+    std::vector<size_t> elems;
+    std::vector<size_t> loc;
+    std::vector<size_t> block_of;
+    std::vector<size_t> first;
+    std::vector<size_t> end;
+    std::vector<size_t> mid;
+
+    explicit Partition(size_t n) : elems(n), loc(n), block_of(n, 0) {
+        for (size_t s = 0; s < n; s++) {
+            elems[s] = s;
+            loc[s] = s;
+        }
+        if (n > 0) {
+            first.push_back(0);
+            end.push_back(n);
+            mid.push_back(0);
+        }
+    }
+
+    size_t size() const {
+        return first.size();
+    }
+
+    size_t block_size(size_t block) const {
+        return end[block] - first[block];
+    }
+
+    // returns true if this is the first state marked in its block
+    bool mark(size_t state) {
+        const size_t block = block_of[state];
+        const size_t i = loc[state];
+        const size_t m = mid[block];
+        if (i < m) {
+            return false;
+        }
+        std::swap(elems[i], elems[m]);
+        loc[elems[i]] = i;
+        loc[elems[m]] = m;
+        mid[block]++;
+        return m == first[block];
+    }
+
+    // Splits off the marked states of `block`; returns the new block or -1 if nothing changed.
+    size_t split(size_t block) {
+        const size_t m = mid[block];
+        mid[block] = first[block];
+        if (m == first[block] or m == end[block]) {
+            return -1;
+        }
+        const size_t created = size();
+        first.push_back(first[block]);
+        end.push_back(m);
+        mid.push_back(first[block]);
+        first[block] = m;
+        mid[block] = m;
+        for (size_t i = first[created]; i < end[created]; i++) {
+            block_of[elems[i]] = created;
+        }
+        return created;
+    }
+
+    // Like split(), but the smaller part becomes the new block, as Valmari–Lehtinen require
+    // for their bound.
+    size_t split_smaller(size_t block) {
+        const size_t m = mid[block];
+        if (m - first[block] <= end[block] - m) {
+            return split(block);
+        }
+        mid[block] = first[block];
+        if (m == end[block]) {
+            return -1;
+        }
+        const size_t created = size();
+        first.push_back(m);
+        end.push_back(end[block]);
+        mid.push_back(m);
+        end[block] = m;
+        for (size_t i = first[created]; i < end[created]; i++) {
+            block_of[elems[i]] = created;
+        }
+        return created;
+    }
+};
+
+// Hopcroft's partition refinement, O(n·|Σ|·log n), over a complete FlatDFA. Returns the
+// class of every state; equivalent states share a class.
+std::vector<uint32_t> hopcroft_classes(const FlatDFA &dfa) {
+    FLA_PHASE("dfa_minim.hopcroft");
+    const size_t n = dfa.size();
+    const size_t k = dfa.width();
+
+    // inverse transitions, grouped by (target, symbol)
+    std::vector<size_t> inv_first(n * k + 1, 0);
+    for (size_t s = 0; s < n; s++) {
+        for (size_t a = 0; a < k; a++) {
+            inv_first[dfa.trans[s * k + a] * k + a + 1]++;
+        }
+    }
+    for (size_t i = 0; i < n * k; i++) {
+        inv_first[i + 1] += inv_first[i];
+    }
+    std::vector<uint32_t> inv_sources(n * k);
+    std::vector<size_t> fill(inv_first.begin(), inv_first.end() - 1);
+    for (size_t s = 0; s < n; s++) {
+        for (size_t a = 0; a < k; a++) {
+            inv_sources[fill[dfa.trans[s * k + a] * k + a]++] = uint32_t(s);
+        }
+    }
+
+    Partition partition(n);
+    for (size_t s = 0; s < n; s++) {
+        if (dfa.final[s]) {
+            partition.mark(s);
+        }
+    }
+    if (n > 0) {
+        partition.split(0);
+    }
+
+    std::vector<std::pair<size_t, size_t>> worklist;
+    std::vector<bool> in_worklist;
+    auto push = [&](size_t block, size_t a) {
+        if (in_worklist.size() < partition.size() * k) {
+            in_worklist.resize(partition.size() * k, false);
+        }
+        if (!in_worklist[block * k + a]) {
+            in_worklist[block * k + a] = true;
+            worklist.emplace_back(block, a);
+        }
+    };
+    if (partition.size() == 2) {
+        const size_t smaller = partition.block_size(0) <= partition.block_size(1) ? 0 : 1;
+        for (size_t a = 0; a < k; a++) {
+            push(smaller, a);
+        }
+    }
+
+    std::vector<size_t> predecessors;
+    std::vector<size_t> touched;
+    while (!worklist.empty()) {
+        const size_t splitter = worklist.back().first;
+        const size_t a = worklist.back().second;
+        worklist.pop_back();
+        in_worklist[splitter * k + a] = false;
+
+        predecessors.clear();
+        for (size_t i = partition.first[splitter]; i < partition.end[splitter]; i++) {
+            const size_t t = partition.elems[i];
+            for (size_t j = inv_first[t * k + a]; j < inv_first[t * k + a + 1]; j++) {
+                predecessors.push_back(inv_sources[j]);
+            }
+        }
+        touched.clear();
+        for (size_t s: predecessors) {
+            if (partition.mark(s)) {
+                touched.push_back(partition.block_of[s]);
+            }
+        }
+        for (size_t block: touched) {
+            const size_t created = partition.split(block);
+            if (created == size_t(-1)) {
+                continue;
+            }
+            const size_t smaller = partition.block_size(created) <= partition.block_size(block) ? created : block;
+            for (size_t b = 0; b < k; b++) {
+                if (in_worklist.size() > block * k + b and in_worklist[block * k + b]) {
+                    push(created, b);
+                } else {
+                    push(smaller, b);
+                }
+            }
+        }
+    }
+
+    FLA_COUNT("dfa_minim.blocks", partition.size());
+    std::vector<uint32_t> class_of(n);
+    for (size_t s = 0; s < n; s++) {
+        class_of[s] = uint32_t(partition.block_of[s]);
+    }
+    return class_of;
 }
 
-StateGroups merge_into_groups(const StateGroups &pairs, const DFA &dfa) {
-    StateGroups groups = pairs;
-    
-    bool has_any_disjoint = true;
-    while (has_any_disjoint) {
-//        std::cout << "count of gruops: " << groups.size() << std::endl;
-        has_any_disjoint = false;
-        StateGroups new_groups;
-        std::set<int> to_remove;
-        
-        for (int i = 1; i < groups.size(); i++){
-            for (int j = 0; j < i; j++){
-                if (has_disjoint(groups[i], groups[j])){
-                    has_any_disjoint = true;
-                    new_groups.push_back(get_union(groups[i], groups[j]));
-                    to_remove.insert(i);
-                    to_remove.insert(j);
-                    // sorry about that :)
-                    goto fin;
+// The states reachable from the initial state that can also reach a final one, renumbered in
+// their original order; everything else is dropped together with the transitions into it.
+// A forward BFS and a backward BFS over the reverse edges of the reached part, O(n + m).
+FlatDFA trim(const FlatDFA &dfa) {
+    FLA_PHASE("dfa_minim.trim");
+    const size_t n = dfa.size();
+    const size_t k = dfa.width();
+    std::vector<bool> reached(n, false);
+    std::vector<uint32_t> queue;
+    if (dfa.initial != FlatDFA::NONE) {
+        reached[dfa.initial] = true;
+        queue.push_back(dfa.initial);
+    }
+    for (size_t i = 0; i < queue.size(); i++) {
+        for (size_t a = 0; a < k; a++) {
+            const uint32_t to = dfa.get_trans(queue[i], a);
+            if (to != FlatDFA::NONE and !reached[to]) {
+                reached[to] = true;
+                queue.push_back(to);
+            }
+        }
+    }
+
+    // reverse edges of the reached part, grouped by target
+    std::vector<size_t> in_first(n + 1, 0);
+    for (uint32_t s: queue) {
+        for (size_t a = 0; a < k; a++) {
+            const uint32_t to = dfa.get_trans(s, a);
+            if (to != FlatDFA::NONE) {
+                in_first[to + 1]++;
+            }
+        }
+    }
+    for (size_t s = 0; s < n; s++) {
+        in_first[s + 1] += in_first[s];
+    }
+    std::vector<uint32_t> sources(in_first[n]);
+    std::vector<size_t> fill(in_first.begin(), in_first.end() - 1);
+    for (uint32_t s: queue) {
+        for (size_t a = 0; a < k; a++) {
+            const uint32_t to = dfa.get_trans(s, a);
+            if (to != FlatDFA::NONE) {
+                sources[fill[to]++] = s;
+            }
+        }
+    }
+
+    std::vector<bool> useful(n, false);
+    std::vector<uint32_t> back_queue;
+    for (uint32_t s: queue) {
+        if (dfa.final[s]) {
+            useful[s] = true;
+            back_queue.push_back(s);
+        }
+    }
+    for (size_t i = 0; i < back_queue.size(); i++) {
+        const uint32_t t = back_queue[i];
+        for (size_t j = in_first[t]; j < in_first[t + 1]; j++) {
+            if (!useful[sources[j]]) {
+                useful[sources[j]] = true;
+                back_queue.push_back(sources[j]);
+            }
+        }
+    }
+
+    FLA_COUNT("dfa_minim.states_trimmed", n - back_queue.size());
+    FlatDFA trimmed(dfa.alphabet);
+    trimmed.trans.reserve(back_queue.size() * k);
+    std::vector<uint32_t> new_id(n, FlatDFA::NONE);
+    for (uint32_t s = 0; s < n; s++) {
+        if (useful[s]) {
+            new_id[s] = trimmed.add_state(dfa.names[s], dfa.final[s]);
+        }
+    }
+    for (uint32_t s = 0; s < n; s++) {
+        if (useful[s]) {
+            for (size_t a = 0; a < k; a++) {
+                const uint32_t to = dfa.get_trans(s, a);
+                if (to != FlatDFA::NONE) {
+                    trimmed.set_trans(new_id[s], a, new_id[to]);
                 }
             }
         }
-    fin:
-        
-        for (int i = 0; i < groups.size(); i++){
-            if (not is_in(i, to_remove)){
-                new_groups.push_back(groups[i]);
+    }
+    if (dfa.initial != FlatDFA::NONE) {
+        trimmed.initial = new_id[dfa.initial];
+    }
+    return trimmed;
+}
+
+// Valmari–Lehtinen refinement of a trimmed, possibly partial FlatDFA in O(m log m) for its m
+// transitions. States sit in a block partition and transitions in a partition of cords (same
+// label, targets in one block); each side is split by the other until both are stable. No dead
+// state is needed: after trimming, no state is equivalent to a missing transition.
+std::vector<uint32_t> valmari_lehtinen_classes(const FlatDFA &dfa) {
+    FLA_PHASE("dfa_minim.valmari_lehtinen");
+    const size_t n = dfa.size();
+    const size_t k = dfa.width();
+
+    // transitions sorted by label, so each label is one contiguous range
+    std::vector<size_t> label_first(k + 1, 0);
+    for (size_t i = 0; i < dfa.trans.size(); i++) {
+        if (dfa.trans[i] != FlatDFA::NONE) {
+            label_first[i % k + 1]++;
+        }
+    }
+    for (size_t a = 0; a < k; a++) {
+        label_first[a + 1] += label_first[a];
+    }
+    const size_t m = label_first[k];
+    std::vector<uint32_t> tail(m);
+    std::vector<uint32_t> head(m);
+    std::vector<size_t> label_fill(label_first.begin(), label_first.end() - 1);
+    for (uint32_t s = 0; s < n; s++) {
+        for (size_t a = 0; a < k; a++) {
+            const uint32_t to = dfa.get_trans(s, a);
+            if (to != FlatDFA::NONE) {
+                tail[label_fill[a]] = s;
+                head[label_fill[a]++] = to;
             }
         }
-        if (has_any_disjoint)
-            groups = new_groups;
-        
     }
-    
-    return groups;
+
+    std::vector<size_t> in_first(n + 1, 0);
+    for (size_t t = 0; t < m; t++) {
+        in_first[head[t] + 1]++;
+    }
+    for (size_t s = 0; s < n; s++) {
+        in_first[s + 1] += in_first[s];
+    }
+    std::vector<uint32_t> incoming(m);
+    std::vector<size_t> fill(in_first.begin(), in_first.end() - 1);
+    for (size_t t = 0; t < m; t++) {
+        incoming[fill[head[t]]++] = uint32_t(t);
+    }
+
+    std::vector<size_t> touched;
+    auto mark = [&](Partition &partition, size_t element) {
+        if (partition.mark(element)) {
+            touched.push_back(partition.block_of[element]);
+        }
+    };
+    auto split = [&](Partition &partition) {
+        for (size_t block: touched) {
+            partition.split_smaller(block);
+        }
+        touched.clear();
+    };
+
+    Partition blocks(n);
+    for (uint32_t s = 0; s < n; s++) {
+        if (dfa.final[s]) {
+            mark(blocks, s);
+        }
+    }
+    split(blocks);
+
+    Partition cords(m);
+    for (size_t a = 1; a < k; a++) {
+        if (label_first[a] < label_first[a + 1]) {
+            for (size_t t = label_first[a]; t < label_first[a + 1]; t++) {
+                cords.mark(t);
+            }
+            cords.split(cords.block_of[label_first[a]]);
+        }
+    }
+
+    size_t b = 1;
+    size_t c = 0;
+    while (c < cords.size()) {
+        for (size_t i = cords.first[c]; i < cords.end[c]; i++) {
+            mark(blocks, tail[cords.elems[i]]);
+        }
+        split(blocks);
+        c++;
+        while (b < blocks.size()) {
+            for (size_t i = blocks.first[b]; i < blocks.end[b]; i++) {
+                const size_t q = blocks.elems[i];
+                for (size_t j = in_first[q]; j < in_first[q + 1]; j++) {
+                    mark(cords, incoming[j]);
+                }
+            }
+            split(cords);
+            b++;
+        }
+    }
+
+    FLA_COUNT("dfa_minim.blocks", blocks.size());
+    FLA_COUNT("dfa_minim.cords", cords.size());
+    std::vector<uint32_t> class_of(n);
+    for (size_t s = 0; s < n; s++) {
+        class_of[s] = uint32_t(blocks.block_of[s]);
+    }
+    return class_of;
 }
 
-std::map<std::string, std::vector<std::string>> get_new_names(const StateGroups &groups, const DFA &dfa) {
-    std::map<std::string, std::vector<std::string>> result;
+enum MinimEngine {
+    valmari_lehtinen, hopcroft, parallel_moore
+};
 
-    // adding ungrouped states
-    for (const auto &state: dfa.get_states()) {
-        // if does not exist in anyone group
-        bool exist = false;
-        for (const auto &group: groups) {
-            if (is_in(state, group)) {
-                exist = true;
-                break;
+// Calls body(begin, end, chunk) for `threads` contiguous chunks of [0, n), chunk 0 on the
+// calling thread.
+template<class F>
+void parallel_chunks(size_t n, size_t threads, const F &body) {
+    const size_t chunk = (n + threads - 1) / threads;
+    std::vector<std::thread> workers;
+    for (size_t t = 1; t < threads; t++) {
+        const size_t begin = std::min(n, t * chunk);
+        const size_t end = std::min(n, begin + chunk);
+        workers.emplace_back([&body, begin, end, t]() {
+            body(begin, end, t);
+        });
+    }
+    body(0, std::min(n, chunk), 0);
+    for (auto &worker: workers) {
+        worker.join();
+    }
+}
+
+// Moore's round-based refinement over a complete FlatDFA, each round spread over `threads`
+// workers (0 = hardware concurrency). A round hashes every state's signature (its class and
+// the classes of its successors) chunk by chunk, buckets the states by hash shard, and each
+// worker interns the signatures of one shard. A class is then numbered by its smallest state,
+// so the result does not depend on the number of threads. Rounds stop once the class count
+// stops growing. That can take up to n rounds (long chains) where Hopcroft pays a log n factor,
+// so this engine is for very large DFAs on many cores.
+std::vector<uint32_t> parallel_moore_classes(const FlatDFA &dfa, size_t threads = 0) {
+    FLA_PHASE("dfa_minim.parallel_moore");
+    const size_t n = dfa.size();
+    const size_t k = dfa.width();
+    if (threads == 0) {
+        threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    }
+    // below a few thousand states per worker the thread start-up dominates
+    threads = std::max<size_t>(std::min(threads, n / 4096), 1);
+
+    std::vector<uint32_t> class_of(n);
+    std::vector<uint32_t> next(n);
+    std::vector<uint64_t> hash(n);
+    std::vector<uint32_t> representative(n);
+    std::vector<uint32_t> by_shard(n);
+    std::vector<size_t> shard_offset(threads * threads + 1);
+    std::vector<size_t> reps_before(threads + 1);
+
+    bool has_final = false;
+    bool has_non_final = false;
+    for (size_t s = 0; s < n; s++) {
+        class_of[s] = dfa.final[s] ? 1 : 0;
+        has_final = has_final or dfa.final[s];
+        has_non_final = has_non_final or !dfa.final[s];
+    }
+    size_t classes = size_t(has_final) + size_t(has_non_final);
+
+    auto mix = [](uint64_t h) {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        return h ^ (h >> 33);
+    };
+    auto signature_hash = [&](uint32_t s) {
+        return size_t(hash[s]);
+    };
+    auto same_signature = [&](uint32_t x, uint32_t y) {
+        if (class_of[x] != class_of[y]) {
+            return false;
+        }
+        for (size_t a = 0; a < k; a++) {
+            if (class_of[dfa.trans[x * k + a]] != class_of[dfa.trans[y * k + a]]) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    while (true) {
+        FLA_PHASE("dfa_minim.moore_round");
+        // hash the signatures; shard_offset[chunk * threads + shard] counts, then offsets
+        std::fill(shard_offset.begin(), shard_offset.end(), 0);
+        parallel_chunks(n, threads, [&](size_t begin, size_t end, size_t chunk) {
+            for (size_t s = begin; s < end; s++) {
+                uint64_t h = mix(class_of[s]);
+                for (size_t a = 0; a < k; a++) {
+                    h = mix(h ^ class_of[dfa.trans[s * k + a]]);
+                }
+                hash[s] = h;
+                shard_offset[chunk * threads + h % threads]++;
+            }
+        });
+        size_t total = 0;
+        for (size_t shard = 0; shard < threads; shard++) {
+            for (size_t chunk = 0; chunk < threads; chunk++) {
+                const size_t count = shard_offset[chunk * threads + shard];
+                shard_offset[chunk * threads + shard] = total;
+                total += count;
             }
         }
-        if (not exist) {
-            result[state] = {state};
+        // stable scatter: within a shard, states stay in increasing order
+        parallel_chunks(n, threads, [&](size_t begin, size_t end, size_t chunk) {
+            std::vector<size_t> at(shard_offset.begin() + chunk * threads,
+                                   shard_offset.begin() + (chunk + 1) * threads);
+            for (size_t s = begin; s < end; s++) {
+                by_shard[at[hash[s] % threads]++] = uint32_t(s);
+            }
+        });
+        parallel_chunks(threads, threads, [&](size_t shard, size_t, size_t) {
+            const size_t begin = shard_offset[shard];
+            const size_t end = shard + 1 < threads ? shard_offset[shard + 1] : n;
+            std::unordered_set<uint32_t, decltype(signature_hash), decltype(same_signature)>
+                    seen(end - begin, signature_hash, same_signature);
+            for (size_t i = begin; i < end; i++) {
+                representative[by_shard[i]] = *seen.insert(by_shard[i]).first;
+            }
+        });
+
+        // number the classes by their smallest state: a prefix count of representatives
+        parallel_chunks(n, threads, [&](size_t begin, size_t end, size_t chunk) {
+            size_t count = 0;
+            for (size_t s = begin; s < end; s++) {
+                count += representative[s] == s;
+            }
+            reps_before[chunk + 1] = count;
+        });
+        for (size_t chunk = 0; chunk < threads; chunk++) {
+            reps_before[chunk + 1] += reps_before[chunk];
         }
+        parallel_chunks(n, threads, [&](size_t begin, size_t end, size_t chunk) {
+            uint32_t id = uint32_t(reps_before[chunk]);
+            for (size_t s = begin; s < end; s++) {
+                if (representative[s] == s) {
+                    next[s] = id++;
+                }
+            }
+        });
+        parallel_chunks(n, threads, [&](size_t begin, size_t end, size_t) {
+            for (size_t s = begin; s < end; s++) {
+                next[s] = next[representative[s]];
+            }
+        });
+
+        class_of.swap(next);
+        const size_t refined = reps_before[threads];
+        if (refined == classes) {
+            FLA_COUNT("dfa_minim.blocks", refined);
+            break;
+        }
+        classes = refined;
     }
+    return class_of;
+}
 
-    for (const auto &group: groups) {
-        bool has_dead = false;
-        if (is_in(DEAD_NAME, group))
-            has_dead = true;
-        
-        if (has_dead) {
+// Disjoint sets over state indices, with path compression and union by rank.
+struct UnionFind {
+    std::vector<size_t> parent;
+    std::vector<uint8_t> rank;
+
+    explicit UnionFind(size_t n) : parent(n), rank(n, 0) {
+        for (size_t i = 0; i < n; i++) {
+            parent[i] = i;
+        }
+    }
+
+    size_t find(size_t x) {
+        size_t root = x;
+        while (parent[root] != root) {
+            root = parent[root];
+        }
+        while (parent[x] != root) {
+            const size_t next = parent[x];
+            parent[x] = root;
+            x = next;
+        }
+        return root;
+    }
+
+    void unite(size_t a, size_t b) {
+        a = find(a);
+        b = find(b);
+        if (a == b) {
+            return;
+        }
+        if (rank[a] < rank[b]) {
+            std::swap(a, b);
+        }
+        parent[b] = a;
+        if (rank[a] == rank[b]) {
+            rank[a]++;
+        }
+    }
+};
+
+// States of the DFA in name order, with the reverse index.
+struct StateIndex {
+    std::vector<std::string> names;
+    std::unordered_map<std::string, size_t> id;
+
+    explicit StateIndex(const DFA &dfa) {
+        for (const auto &state: dfa.get_states()) {
+            id[state] = names.size();
+            names.push_back(state);
+        }
+    }
+};
+
+// Joins overlapping groups (e.g. equivalent pairs) into disjoint classes.
+StateGroups merge_into_groups(const StateGroups &pairs, const DFA &dfa) {
+    const StateIndex index(dfa);
+    UnionFind classes(index.names.size());
+    std::vector<bool> grouped(index.names.size(), false);
+    for (const auto &pair: pairs) {
+        const size_t first = index.id.at(*pair.begin());
+        for (const auto &state: pair) {
+            classes.unite(first, index.id.at(state));
+            grouped[index.id.at(state)] = true;
+        }
+    }
+
+    std::vector<size_t> group_of(index.names.size(), -1);
+    StateGroups groups;
+    for (size_t s = 0; s < index.names.size(); s++) {
+        if (!grouped[s]) {
             continue;
         }
+        const size_t root = classes.find(s);
+        if (group_of[root] == size_t(-1)) {
+            group_of[root] = groups.size();
+            groups.emplace_back();
+        }
+        groups[group_of[root]].insert(index.names[s]);
+    }
+    return groups;
+}
+
+// One linear pass: every state gets a class index, each class its new name (members joined
+// with '_', or the state's own name when it is alone), and the transitions of the class's
+// first member are redirected through the index. Groups containing DEAD_NAME are dropped
+// together with the transitions into them.
+DFA build_dfa(const StateGroups &groups, const DFA &dfa) {
+    const StateIndex index(dfa);
+    const size_t n = index.names.size();
+    const size_t none = -1;
+
+    std::vector<size_t> class_of(n, none);
+    std::vector<std::string> class_name;
+    std::vector<size_t> representative;
+    std::vector<bool> dropped;
+    for (const auto &group: groups) {
         std::string new_name;
         for (const auto &state: group) {
             new_name += state + "_";
+            class_of[index.id.at(state)] = class_name.size();
+        }
+        class_name.push_back(new_name);
+        representative.push_back(index.id.at(*group.begin()));
+        dropped.push_back(is_in(DEAD_NAME, group));
+    }
+    for (size_t s = 0; s < n; s++) {
+        if (class_of[s] == none) {
+            class_of[s] = class_name.size();
+            class_name.push_back(index.names[s]);
+            representative.push_back(s);
+            dropped.push_back(false);
         }
-        result[new_name] = {};
-        std::copy(group.begin(), group.end(), std::back_inserter(result[new_name]));
     }
 
-    return result;
+    DFA minimised_dfa(dfa.get_alphabet());
+    const auto final_states = dfa.get_final_states();
+    for (size_t c = 0; c < class_name.size(); c++) {
+        if (!dropped[c]) {
+            minimised_dfa.create_state(class_name[c], is_in(index.names[representative[c]], final_states));
+        }
+    }
+    for (size_t c = 0; c < class_name.size(); c++) {
+        if (dropped[c]) {
+            continue;
+        }
+        const std::string &from = index.names[representative[c]];
+        for (const char sym: dfa.get_alphabet().to_string()) {
+            if (dfa.has_trans(from, sym)) {
+                const size_t to = class_of[index.id.at(dfa.get_trans(from, sym))];
+                if (!dropped[to]) {
+                    minimised_dfa.set_trans(class_name[c], sym, class_name[to]);
+                }
+            }
+        }
+    }
+    const size_t init = class_of[index.id.at(dfa.get_initial_state())];
+    if (!dropped[init]) {
+        minimised_dfa.set_initial(class_name[init]);
+    }
+
+    return minimised_dfa;
 }
 
-std::string in_new_names(const std::map<std::string, std::vector<std::string>> &new_names, const std::string &name) {
-    for (const auto &new_name: new_names) {
-        if (is_in(name, new_name.second)) {
-            return new_name.first;
+// Quotient of `dfa` by `class_of`, restricted to the classes reachable from the initial one.
+// Names follow build_dfa: members joined with '_' in name order, or the state's own name when
+// it is alone. The class of `dead`, if there is one, is dropped together with the transitions
+// into it.
+FlatDFA build_minimal(const FlatDFA &dfa, const std::vector<uint32_t> &class_of, uint32_t dead) {
+    FLA_PHASE("dfa_minim.build_minimal");
+    const size_t classes = dfa.size() == 0 ? 0 : *std::max_element(class_of.begin(), class_of.end()) + 1;
+    std::vector<std::vector<uint32_t>> members(classes);
+    for (uint32_t s = 0; s < dfa.size(); s++) {
+        members[class_of[s]].push_back(s);
+    }
+
+    FlatDFA minimised_dfa(dfa.alphabet);
+    std::vector<uint32_t> new_id(classes, FlatDFA::NONE);
+    std::vector<uint32_t> queue;
+    auto visit = [&](uint32_t c) {
+        if (new_id[c] == FlatDFA::NONE) {
+            auto &group = members[c];
+            std::sort(group.begin(), group.end(), [&](uint32_t a, uint32_t b) {
+                return dfa.names[a] < dfa.names[b];
+            });
+            std::string new_name = group.size() == 1 ? dfa.names[group[0]] : "";
+            if (group.size() > 1) {
+                for (uint32_t state: group) {
+                    new_name += dfa.names[state] + "_";
+                }
+            }
+            new_id[c] = minimised_dfa.add_state(new_name, dfa.final[group[0]]);
+            queue.push_back(c);
         }
+        return new_id[c];
+    };
+
+    const uint32_t dead_class = dead == FlatDFA::NONE ? FlatDFA::NONE : class_of[dead];
+    if (dfa.initial == FlatDFA::NONE or class_of[dfa.initial] == dead_class) {
+        return minimised_dfa;
     }
-    return "Error";
+    minimised_dfa.initial = visit(class_of[dfa.initial]);
+    for (size_t i = 0; i < queue.size(); i++) {
+        const uint32_t c = queue[i];
+        for (size_t a = 0; a < dfa.width(); a++) {
+            const uint32_t next = dfa.get_trans(members[c][0], a);
+            const uint32_t to = next == FlatDFA::NONE ? dead_class : class_of[next];
+            if (to != dead_class) {
+                const uint32_t target = visit(to);
+                minimised_dfa.set_trans(new_id[c], a, target);
+            }
+        }
+    }
+    return minimised_dfa;
 }
 
-bool is_final(const std::vector<std::string> &group, const DFA &dfa){
-    if (is_in(group[0], dfa.get_final_states())){
-        return true;
+// `threads` is only used by the parallel_moore engine (0 = hardware concurrency). Unreachable
+// and dead states are trimmed before refinement; the engines that need a complete automaton
+// then get a dead state. The input DFA is never modified.
+DFA dfa_minim(DFA &d, MinimEngine engine, size_t threads = 0) {
+    FLA_PHASE("dfa_minim");
+    const FlatDFA input = FlatDFA::from_api(d);
+    FLA_COUNT("dfa_minim.states_in", input.size());
+    FlatDFA dfa = trim(input);
+    uint32_t dead = FlatDFA::NONE;
+    std::vector<uint32_t> class_of;
+    if (engine == valmari_lehtinen) {
+        class_of = valmari_lehtinen_classes(dfa);
     } else {
-        return false;
+        dead = add_dead_state(dfa);
+        class_of = engine == parallel_moore ? parallel_moore_classes(dfa, threads) : hopcroft_classes(dfa);
     }
+    const auto minim_dfa = build_minimal(dfa, class_of, dead);
+    FLA_COUNT("dfa_minim.states_out", minim_dfa.size());
+    return minim_dfa.to_api();
 }
 
-std::string get_initial(const std::map<std::string, std::vector<std::string>> &groups, const DFA &dfa){
-    auto init_state = dfa.get_initial_state();
-    for (const auto &group: groups) {
-        if (is_in(init_state, group.second)){
-            return group.first;
-        }
+DFA dfa_minim(DFA &d) {
+    return dfa_minim(d, valmari_lehtinen);
+}
+
+// The original pairwise pipeline, kept as an independent check on the other engines (test.cpp
+// compares them all). It runs on the trimmed automaton, so every class of the result is
+// reachable.
+DFA dfa_minim_reference(DFA &d) {
+    FLA_PHASE("dfa_minim.reference");
+    DFA trimmed = trim(FlatDFA::from_api(d)).to_api();
+    if (trimmed.get_states().empty()) {
+        return trimmed;
     }
-    return "Error";
+    add_dead_state(trimmed);
+    auto pairs = get_state_equ_pairs(trimmed);
+    auto groups = merge_into_groups(pairs, trimmed);
+    auto minim_dfa = build_dfa(groups, trimmed);
+    minim_dfa.delete_state(DEAD_NAME);
+    return minim_dfa;
 }
-    
-    
-DFA build_dfa(const StateGroups &groups, const DFA &dfa) {
-    DFA minimised_dfa(dfa.get_alphabet());
-    auto new_names = get_new_names(groups, dfa);
-    for (const auto &new_name: new_names) {
-        minimised_dfa.create_state(new_name.first, is_final(new_name.second, dfa));
+
+// A DFA kept together with its partition into equivalence classes, so that after a few edits
+// only the affected part is re-minimised. Only states that can reach an edited state may change
+// language; update() takes them out of their classes, refines them among themselves (Moore,
+// with every other state fixed to its class) and then decides for each local class whether it
+// equals an old class. Old classes are indexed by signature (final bit and successor classes),
+// so a local class whose successors are all resolved is settled by one lookup, and local
+// classes are visited successors first. Only those left on cycles of undecided classes are
+// probed with a Hopcroft–Karp walk, which stops at pairs of resolved states. update() falls back
+// to a full rebuild when more than half of the live states can reach the edits (the search for
+// them stops there), or when some cycle has no resolved successor to probe with other than the
+// dead state. Predecessor lists are kept exact, so an update never walks the edit history.
+class IncrementalMinimizer {
+public:
+    static const uint32_t NONE = FlatDFA::NONE;
+    // update() rebuilds outright when the affected region holds more than 1/REBUILD_FRACTION
+    // of the live states
+    static const size_t REBUILD_FRACTION = 2;
+
+    // Classes that disappeared and appeared in an update, named as in dfa_minim but after all
+    // their members, including those minimal() trims away.
+    struct Delta {
+        std::vector<std::string> removed;
+        std::vector<std::string> added;
+    };
+
+    explicit IncrementalMinimizer(const DFA &dfa) : automaton(FlatDFA::from_api(dfa)) {
+        for (uint32_t s = 0; s < automaton.size(); s++) {
+            ids[automaton.names[s]] = s;
+        }
+        dead = add_dead_state(automaton);
+        deleted.assign(automaton.size(), false);
+        region_id.assign(automaton.size(), NONE);
+        pred.resize(automaton.size());
+        pred_slot.resize(automaton.trans.size());
+        for (uint32_t e = 0; e < automaton.trans.size(); e++) {
+            link(e);
+        }
+        rebuild();
+        index_signatures();
     }
 
-    for (const auto &new_name: new_names) {
-        for (const char sym: dfa.get_alphabet().to_string()) {
-            if (dfa.has_trans(new_name.second[0], sym)) {
-                const auto trans_to = in_new_names(new_names, dfa.get_trans(new_name.second[0], sym));
-                bool x = minimised_dfa.set_trans(new_name.first, sym, trans_to);
-                x = not x;
+    bool add_state(const std::string &name, bool is_final = false) {
+        if (is_in(name, ids) or name == DEAD_NAME) {
+            return false;
+        }
+        const uint32_t s = automaton.add_state(name, is_final);
+        ids[name] = s;
+        deleted.push_back(false);
+        region_id.push_back(NONE);
+        pred.emplace_back();
+        pred_slot.resize(automaton.trans.size());
+        class_of.push_back(NONE);
+        slot.push_back(0);
+        for (size_t a = 0; a < automaton.width(); a++) {
+            automaton.set_trans(s, a, dead);
+            link(uint32_t(s * automaton.width() + a));
+        }
+        edited.push_back(s);
+        return true;
+    }
 
+    bool delete_state(const std::string &name) {
+        const uint32_t s = id_of(name);
+        if (s == NONE) {
+            return false;
+        }
+        const std::vector<uint32_t> into = pred[s];
+        for (uint32_t e: into) {
+            const uint32_t p = uint32_t(e / automaton.width());
+            if (!deleted[p] and p != s) {
+                redirect(p, e % automaton.width(), dead);
             }
         }
+        if (class_of[s] != NONE) {
+            remove_member(s);
+        }
+        deleted[s] = true;
+        deleted_count++;
+        ids.erase(name);
+        if (automaton.initial == s) {
+            automaton.initial = NONE;
+        }
+        return true;
     }
-    auto init = get_initial(new_names, dfa);
-    
-    minimised_dfa.set_initial(init);
-    
-    return minimised_dfa;
-}
 
-int c = 0;
+    bool set_trans(const std::string &from, char sym, const std::string &to) {
+        const uint32_t s = id_of(from);
+        const uint32_t t = id_of(to);
+        const size_t a = automaton.alphabet.find(sym);
+        if (s == NONE or t == NONE or a == std::string::npos) {
+            return false;
+        }
+        redirect(s, a, t);
+        return true;
+    }
 
-void walk(const std::string &from_state, std::map<std::string, bool> &marked, const DFA& dfa){
-    marked[from_state] = true;
-    
-    for (const char sym:dfa.get_alphabet().to_string()) {
-        if (dfa.has_trans(from_state, sym)){
-            const auto trans = dfa.get_trans(from_state, sym);
-            if (not marked[trans]){
-                walk(trans, marked, dfa);
+    bool remove_trans(const std::string &from, char sym) {
+        const uint32_t s = id_of(from);
+        const size_t a = automaton.alphabet.find(sym);
+        if (s == NONE or a == std::string::npos) {
+            return false;
+        }
+        redirect(s, a, dead);
+        return true;
+    }
+
+    bool set_final(const std::string &name, bool is_final) {
+        const uint32_t s = id_of(name);
+        if (s == NONE) {
+            return false;
+        }
+        if (automaton.final[s] != is_final) {
+            automaton.final[s] = is_final;
+            edited.push_back(s);
+        }
+        return true;
+    }
+
+    bool set_initial(const std::string &name) {
+        const uint32_t s = id_of(name);
+        if (s == NONE) {
+            return false;
+        }
+        automaton.initial = s;
+        return true;
+    }
+
+    Delta update() {
+        FLA_PHASE("incremental.update");
+        // refining most of the automaton locally costs more than a rebuild
+        std::vector<uint32_t> rest;
+        bool decided = affected_region((automaton.size() - deleted_count) / REBUILD_FRACTION, rest);
+        FLA_COUNT("incremental.region_states", rest.size());
+        if (decided) {
+            for (uint32_t s: rest) {
+                if (class_of[s] != NONE) {
+                    remove_member(s);
+                }
             }
         }
+
+        // Local classes only tell unresolved states apart exactly once none of them equals an
+        // old class, so after a round that merged anything the rest is refined again.
+        std::vector<std::vector<uint32_t>> groups;
+        std::vector<GroupState> state;
+        size_t previous = 0;
+        while (decided and !rest.empty() and rest.size() != previous) {
+            previous = rest.size();
+            const std::vector<uint32_t> local = local_classes(rest);
+            groups.assign(*std::max_element(local.begin(), local.end()) + 1, {});
+            for (size_t i = 0; i < rest.size(); i++) {
+                groups[local[i]].push_back(rest[i]);
+            }
+            decided = resolve_groups(local, groups, state);
+            std::vector<uint32_t> unresolved;
+            for (uint32_t s: rest) {
+                if (region_id[s] != NONE) {
+                    region_id[s] = uint32_t(unresolved.size());
+                    unresolved.push_back(s);
+                }
+            }
+            rest.swap(unresolved);
+        }
+
+        std::set<std::string> names_before;
+        std::set<std::string> names_after;
+        if (!decided) {
+            for (uint32_t s: rest) {
+                region_id[s] = NONE;
+            }
+            rebuild(names_before, names_after);
+        } else {
+            std::vector<uint32_t> created;
+            for (size_t g = 0; g < groups.size(); g++) {
+                if (state[g] == fresh) {
+                    const uint32_t c = new_class();
+                    for (uint32_t s: groups[g]) {
+                        region_id[s] = NONE;
+                        add_member(s, c);
+                    }
+                    created.push_back(c);
+                }
+            }
+            for (uint32_t c: created) {
+                if (signatures_indexed) {
+                    by_signature[signature(members[c][0])] = c;
+                }
+            }
+            // only classes whose membership changed can change name
+            for (auto &change: changes) {
+                std::sort(change.second.removed.begin(), change.second.removed.end());
+                std::sort(change.second.added.begin(), change.second.added.end());
+                if (change.second.removed != change.second.added) {
+                    insert_name(names_before, members_before(change.first));
+                    insert_name(names_after, members[change.first]);
+                }
+            }
+        }
+        changes.clear();
+
+        Delta delta;
+        std::set_difference(names_before.begin(), names_before.end(), names_after.begin(), names_after.end(),
+                            std::back_inserter(delta.removed));
+        std::set_difference(names_after.begin(), names_after.end(), names_before.begin(), names_before.end(),
+                            std::back_inserter(delta.added));
+        return delta;
     }
-}
 
-void delete_unattainable(DFA& dfa){
-    auto init_state = dfa.get_initial_state();
-    
-    std::map<std::string, bool> marked;
-    for (const auto& state:dfa.get_states()) {
-        marked[state] = false;
+    // The current minimal DFA, as dfa_minim would return it; pending edits need update() first.
+    // Deleted states and the dead state are unreachable or dead, so trimming drops them.
+    DFA minimal() const {
+        const FlatDFA trimmed = trim(automaton);
+        std::vector<uint32_t> classes(trimmed.size());
+        for (uint32_t s = 0; s < trimmed.size(); s++) {
+            classes[s] = class_of[ids.at(trimmed.names[s])];
+        }
+        return build_minimal(trimmed, classes, FlatDFA::NONE).to_api();
     }
-    
-    walk(init_state, marked, dfa);
-    
-    for (const auto& state:dfa.get_states()) {
-        if (not marked[state]){
-            dfa.delete_state(state);
+
+private:
+    uint32_t id_of(const std::string &name) const {
+        const auto it = ids.find(name);
+        return it == ids.end() ? NONE : it->second;
+    }
+
+    void redirect(uint32_t s, size_t a, uint32_t t) {
+        if (automaton.get_trans(s, a) != t) {
+            const uint32_t e = uint32_t(s * automaton.width() + a);
+            unlink(e);
+            automaton.trans[e] = t;
+            link(e);
+            edited.push_back(s);
+        }
+    }
+
+    // pred[t] holds the transitions into t as indices into automaton.trans, and pred_slot[e]
+    // is the place of e in its list, so redirecting a transition moves one entry
+    void link(uint32_t e) {
+        auto &into = pred[automaton.trans[e]];
+        pred_slot[e] = uint32_t(into.size());
+        into.push_back(e);
+    }
+
+    void unlink(uint32_t e) {
+        auto &into = pred[automaton.trans[e]];
+        into[pred_slot[e]] = into.back();
+        pred_slot[into.back()] = pred_slot[e];
+        into.pop_back();
+    }
+
+    // Collects the states that can reach an edited state; region_id numbers them. Returns false,
+    // with the search cut short, once there are more than `limit` of them.
+    bool affected_region(size_t limit, std::vector<uint32_t> &region) {
+        auto visit = [&](uint32_t s) {
+            if (!deleted[s] and region_id[s] == NONE) {
+                region_id[s] = uint32_t(region.size());
+                region.push_back(s);
+            }
+        };
+        for (uint32_t s: edited) {
+            visit(s);
+        }
+        edited.clear();
+        for (size_t i = 0; i < region.size() and region.size() <= limit; i++) {
+            for (uint32_t e: pred[region[i]]) {
+                visit(uint32_t(e / automaton.width()));
+            }
+        }
+        return region.size() <= limit;
+    }
+
+    // Moore refinement of `rest`, successors outside it standing for their (fixed) class
+    std::vector<uint32_t> local_classes(const std::vector<uint32_t> &rest) const {
+        std::vector<uint32_t> local(rest.size());
+        bool seen[2] = {false, false};
+        for (size_t i = 0; i < rest.size(); i++) {
+            local[i] = automaton.final[rest[i]] ? 1 : 0;
+            seen[local[i]] = true;
+        }
+        size_t count = size_t(seen[0]) + size_t(seen[1]);
+        std::vector<uint32_t> next(rest.size());
+        std::map<std::vector<uint64_t>, uint32_t> signatures;
+        std::vector<uint64_t> signature;
+        while (true) {
+            signatures.clear();
+            for (size_t i = 0; i < rest.size(); i++) {
+                signature.assign(1, local[i]);
+                for (size_t a = 0; a < automaton.width(); a++) {
+                    const uint32_t t = automaton.get_trans(rest[i], a);
+                    signature.push_back(region_id[t] == NONE ? class_of[t] : (1ULL << 32) | local[region_id[t]]);
+                }
+                const uint32_t fresh = uint32_t(signatures.size());
+                next[i] = signatures.emplace(signature, fresh).first->second;
+            }
+            local.swap(next);
+            if (signatures.size() == count) {
+                return local;
+            }
+            count = signatures.size();
         }
     }
-}
 
-void delete_non_generative(DFA& dfa){
-    bool has_any_non_generative = true;
-    while (has_any_non_generative) {
-        has_any_non_generative = false;
-        for (const auto& state:dfa.get_states()) {
-            if (not is_in(state, dfa.get_final_states())) {
-                bool is_non_generative = true;
-                for (const char sym: dfa.get_alphabet().to_string()) {
-                    if (dfa.has_trans(state, sym) and dfa.get_trans(state, sym) != state) {
-                        is_non_generative = false;
-                        break;
+    enum GroupState {
+        undecided, merged, fresh
+    };
+
+    // Decides for each local group whether it joins an old class (merged) or becomes a class of
+    // its own (fresh). A group with a successor in a fresh group is fresh, as old states only
+    // lead to old states; a group whose successors are all resolved is looked up by signature.
+    // Settling a group requeues the groups leading to it. Groups left undecided lie on cycles
+    // and are probed one at a time. Returns false if some group stays undecided.
+    bool resolve_groups(const std::vector<uint32_t> &local, const std::vector<std::vector<uint32_t>> &groups,
+                        std::vector<GroupState> &state) {
+        state.assign(groups.size(), undecided);
+        std::vector<std::vector<uint32_t>> dependents(groups.size());
+        std::vector<uint32_t> work;
+        for (uint32_t g = 0; g < groups.size(); g++) {
+            for (size_t a = 0; a < automaton.width(); a++) {
+                const uint32_t t = automaton.get_trans(groups[g][0], a);
+                if (region_id[t] != NONE) {
+                    dependents[local[region_id[t]]].push_back(g);
+                }
+            }
+            work.push_back(g);
+        }
+        std::vector<uint32_t> to_probe = work;
+
+        auto settle = [&](uint32_t g, uint32_t c) {
+            state[g] = c == NONE ? fresh : merged;
+            if (c != NONE) {
+                for (uint32_t s: groups[g]) {
+                    region_id[s] = NONE;
+                    add_member(s, c);
+                }
+            }
+            work.insert(work.end(), dependents[g].begin(), dependents[g].end());
+            to_probe.insert(to_probe.end(), dependents[g].begin(), dependents[g].end());
+        };
+
+        std::vector<std::pair<uint32_t, uint32_t>> joined;
+        while (true) {
+            while (!work.empty()) {
+                const uint32_t g = work.back();
+                work.pop_back();
+                if (state[g] != undecided) {
+                    continue;
+                }
+                bool resolved = true;
+                bool leads_to_fresh = false;
+                for (size_t a = 0; a < automaton.width(); a++) {
+                    const uint32_t t = automaton.get_trans(groups[g][0], a);
+                    if (region_id[t] != NONE) {
+                        resolved = false;
+                        leads_to_fresh = leads_to_fresh or state[local[region_id[t]]] == fresh;
                     }
                 }
-                if (is_non_generative) {
-                    has_any_non_generative = true;
-                    dfa.delete_state(state);
+                if (leads_to_fresh) {
+                    settle(g, NONE);
+                } else if (resolved) {
+                    FLA_COUNT("incremental.signature_lookups", 1);
+                    settle(g, class_by_signature(groups[g][0]));
+                }
+            }
+
+            bool progress = false;
+            while (!progress and !to_probe.empty()) {
+                const uint32_t g = to_probe.back();
+                to_probe.pop_back();
+                if (state[g] != undecided or !probe(groups[g][0], joined)) {
+                    continue;
+                }
+                progress = true;
+                if (joined.empty()) {
+                    settle(g, NONE);
+                }
+                for (const auto &state_class: joined) {
+                    const uint32_t s = state_class.first;
+                    if (region_id[s] != NONE and state[local[region_id[s]]] == undecided) {
+                        settle(local[region_id[s]], state_class.second);
+                    }
                 }
             }
+            if (!progress) {
+                return std::find(state.begin(), state.end(), undecided) == state.end();
+            }
         }
     }
+
+    // final bit and successor classes of a state whose successors are all resolved
+    std::string signature(uint32_t s) const {
+        std::string key(1, automaton.final[s] ? '1' : '0');
+        for (size_t a = 0; a < automaton.width(); a++) {
+            const uint32_t c = class_of[automaton.get_trans(s, a)];
+            key.append(reinterpret_cast<const char *>(&c), sizeof(c));
+        }
+        return key;
+    }
+
+    // The class with the signature of s, or NONE. Entries go stale when their class empties and
+    // its id is reused; they are checked against a current member here.
+    uint32_t class_by_signature(uint32_t s) {
+        if (!signatures_indexed) {
+            index_signatures();
+        }
+        const std::string key = signature(s);
+        const auto it = by_signature.find(key);
+        if (it == by_signature.end()) {
+            return NONE;
+        }
+        const uint32_t c = it->second;
+        if (members[c].empty() or signature(members[c][0]) != key) {
+            by_signature.erase(it);
+            return NONE;
+        }
+        return c;
+    }
+
+    void index_signatures() {
+        for (uint32_t c = 0; c < members.size(); c++) {
+            if (!members[c].empty()) {
+                by_signature[signature(members[c][0])] = c;
+            }
+        }
+        signatures_indexed = true;
+    }
+
+    // Probes the undecided state x through a resolved successor outside the dead state's class:
+    // an equivalent old state must reach that successor's class on the same symbol, so the
+    // candidates are read off its predecessor lists, filtered by x's other resolved successors,
+    // and confirmed with a walk. On success `joined` holds every unresolved state the walk proved
+    // equivalent to an old class; it is left empty if x is refuted. Returns false if x has no
+    // successor to probe with.
+    bool probe(uint32_t x, std::vector<std::pair<uint32_t, uint32_t>> &joined) {
+        joined.clear();
+        size_t best_a = automaton.width();
+        for (size_t a = 0; a < automaton.width(); a++) {
+            const uint32_t t = automaton.get_trans(x, a);
+            if (region_id[t] == NONE and class_of[t] != class_of[dead] and
+                (best_a == automaton.width() or
+                 members[class_of[t]].size() < members[class_of[automaton.get_trans(x, best_a)]].size())) {
+                best_a = a;
+            }
+        }
+        if (best_a == automaton.width()) {
+            return false;
+        }
+
+        std::set<uint32_t> candidates;
+        for (uint32_t m: members[class_of[automaton.get_trans(x, best_a)]]) {
+            for (uint32_t e: pred[m]) {
+                const uint32_t p = uint32_t(e / automaton.width());
+                if (e % automaton.width() == best_a and !deleted[p] and region_id[p] == NONE and
+                    class_of[p] != NONE and !is_in(class_of[p], candidates) and agrees(x, p)) {
+                    candidates.insert(class_of[p]);
+                }
+            }
+        }
+        for (uint32_t c: candidates) {
+            FLA_COUNT("incremental.walks", 1);
+            walk_parent.clear();
+            walk_tag.clear();
+            if (equivalent_walk(x, members[c][0], walk_parent, walk_tag)) {
+                for (const auto &node: walk_parent) {
+                    uint32_t root = node.first;
+                    while (walk_parent[root] != root) {
+                        root = walk_parent[root];
+                    }
+                    if (region_id[node.first] != NONE and walk_tag[root] != NONE) {
+                        joined.emplace_back(node.first, walk_tag[root]);
+                    }
+                }
+                return true;
+            }
+        }
+        return true;
+    }
+
+    // same final bit, and the same class wherever x already has a resolved successor
+    bool agrees(uint32_t x, uint32_t p) const {
+        if (automaton.final[x] != automaton.final[p]) {
+            return false;
+        }
+        for (size_t a = 0; a < automaton.width(); a++) {
+            const uint32_t t = automaton.get_trans(x, a);
+            if (region_id[t] == NONE and class_of[t] != class_of[automaton.get_trans(p, a)]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Hopcroft–Karp from (x, y). A set holding a resolved state is tagged with its class; two
+    // different tags in one set, or a final/non-final pair, refute the equivalence.
+    bool equivalent_walk(uint32_t x, uint32_t y, std::unordered_map<uint32_t, uint32_t> &parent,
+                         std::unordered_map<uint32_t, uint32_t> &tag) const {
+        auto find = [&](uint32_t s) {
+            if (parent.emplace(s, s).second) {
+                tag[s] = region_id[s] == NONE ? class_of[s] : NONE;
+                return s;
+            }
+            while (parent[s] != s) {
+                parent[s] = parent[parent[s]];
+                s = parent[s];
+            }
+            return s;
+        };
+        std::vector<std::pair<uint32_t, uint32_t>> stack = {{x, y}};
+        while (!stack.empty()) {
+            const uint32_t p = stack.back().first;
+            const uint32_t q = stack.back().second;
+            stack.pop_back();
+            if (automaton.final[p] != automaton.final[q]) {
+                return false;
+            }
+            const uint32_t rp = find(p);
+            const uint32_t rq = find(q);
+            if (rp == rq) {
+                continue;
+            }
+            const uint32_t tp = tag[rp];
+            const uint32_t tq = tag[rq];
+            if (tp != NONE and tq != NONE and tp != tq) {
+                return false;
+            }
+            parent[rq] = rp;
+            tag[rp] = tp != NONE ? tp : tq;
+            // two sets already known to be one class need no further checks
+            if (tp != NONE and tp == tq) {
+                continue;
+            }
+            for (size_t a = 0; a < automaton.width(); a++) {
+                stack.emplace_back(automaton.get_trans(p, a), automaton.get_trans(q, a));
+            }
+        }
+        return true;
+    }
+
+    // rebuild() from update(): names the classes before and after that are not the same set of
+    // states, which is usually far fewer than all of them
+    void rebuild(std::set<std::string> &names_before, std::set<std::string> &names_after) {
+        std::vector<std::vector<uint32_t>> before(members.size());
+        std::vector<uint32_t> class_before(automaton.size(), NONE);
+        for (uint32_t c = 0; c < members.size(); c++) {
+            before[c] = members_before(c);
+            for (uint32_t s: before[c]) {
+                class_before[s] = c;
+            }
+        }
+        rebuild();
+        std::vector<bool> kept(before.size(), false);
+        for (uint32_t c = 0; c < members.size(); c++) {
+            const uint32_t old = class_before[members[c][0]];
+            bool same = old != NONE and before[old].size() == members[c].size();
+            for (size_t i = 0; same and i < members[c].size(); i++) {
+                same = class_before[members[c][i]] == old;
+            }
+            if (same) {
+                kept[old] = true;
+            } else {
+                insert_name(names_after, members[c]);
+            }
+        }
+        for (uint32_t c = 0; c < before.size(); c++) {
+            if (!kept[c]) {
+                insert_name(names_before, before[c]);
+            }
+        }
+    }
+
+    void rebuild() {
+        FLA_COUNT("incremental.rebuilds", 1);
+        const auto block_of = hopcroft_classes(automaton);
+        members.clear();
+        free_classes.clear();
+        class_of.assign(automaton.size(), NONE);
+        slot.assign(automaton.size(), 0);
+        std::vector<uint32_t> renumber(automaton.size(), NONE);
+        for (uint32_t s = 0; s < automaton.size(); s++) {
+            if (!deleted[s]) {
+                if (renumber[block_of[s]] == NONE) {
+                    renumber[block_of[s]] = new_class();
+                }
+                place(s, renumber[block_of[s]]);
+            }
+        }
+        // after a rebuild the signature index is refilled on its first lookup, so rebuilds in a
+        // row skip it
+        if (signatures_indexed) {
+            by_signature.clear();
+            signatures_indexed = false;
+        }
+        changes.clear();
+    }
+
+    uint32_t new_class() {
+        if (!free_classes.empty()) {
+            const uint32_t c = free_classes.back();
+            free_classes.pop_back();
+            return c;
+        }
+        members.emplace_back();
+        return uint32_t(members.size() - 1);
+    }
+
+    void add_member(uint32_t s, uint32_t c) {
+        place(s, c);
+        changes[c].added.push_back(s);
+    }
+
+    // add_member without recording the change, for rebuild()
+    void place(uint32_t s, uint32_t c) {
+        class_of[s] = c;
+        slot[s] = uint32_t(members[c].size());
+        members[c].push_back(s);
+    }
+
+    void remove_member(uint32_t s) {
+        const uint32_t c = class_of[s];
+        auto &group = members[c];
+        group[slot[s]] = group.back();
+        slot[group[slot[s]]] = slot[s];
+        group.pop_back();
+        class_of[s] = NONE;
+        changes[c].removed.push_back(s);
+        if (group.empty()) {
+            free_classes.push_back(c);
+        }
+    }
+
+    // the members class c had before the changes recorded since the last update
+    std::vector<uint32_t> members_before(uint32_t c) const {
+        const auto it = changes.find(c);
+        if (it == changes.end()) {
+            return members[c];
+        }
+        const std::unordered_set<uint32_t> added(it->second.added.begin(), it->second.added.end());
+        std::vector<uint32_t> group;
+        for (uint32_t s: members[c]) {
+            if (!is_in(s, added)) {
+                group.push_back(s);
+            }
+        }
+        group.insert(group.end(), it->second.removed.begin(), it->second.removed.end());
+        return group;
+    }
+
+    // adds the dfa_minim name of a class with these members, unless it is empty or dead
+    void insert_name(std::set<std::string> &names, const std::vector<uint32_t> &group) const {
+        std::vector<std::string> sorted;
+        for (uint32_t s: group) {
+            if (s == dead) {
+                return;
+            }
+            sorted.push_back(automaton.names[s]);
+        }
+        if (sorted.size() == 1) {
+            names.insert(sorted[0]);
+        } else if (!sorted.empty()) {
+            std::sort(sorted.begin(), sorted.end());
+            std::string name;
+            for (const auto &state: sorted) {
+                name += state + "_";
+            }
+            names.insert(name);
+        }
+    }
+
+    // states that joined and left a class since the last update
+    struct Change {
+        std::vector<uint32_t> removed;
+        std::vector<uint32_t> added;
+    };
+
+    FlatDFA automaton;
+    uint32_t dead;
+    std::unordered_map<std::string, uint32_t> ids;
+    std::vector<bool> deleted;
+    size_t deleted_count = 0;
+    std::vector<std::vector<uint32_t>> pred;
+    std::vector<uint32_t> pred_slot;
+    std::vector<uint32_t> class_of;
+    std::vector<uint32_t> slot;
+    std::vector<std::vector<uint32_t>> members;
+    std::vector<uint32_t> free_classes;
+    std::vector<uint32_t> region_id;
+    std::vector<uint32_t> edited;
+    std::unordered_map<uint32_t, Change> changes;
+    std::unordered_map<std::string, uint32_t> by_signature;
+    bool signatures_indexed = false;
+    std::unordered_map<uint32_t, uint32_t> walk_parent;
+    std::unordered_map<uint32_t, uint32_t> walk_tag;
+};
+
+const uint32_t IncrementalMinimizer::NONE;
+const size_t IncrementalMinimizer::REBUILD_FRACTION;
+
+// Two api DFAs read side by side over the union of their alphabets. NONE stands for the dead
+// state either automaton falls into on a missing transition or a symbol it does not know.
+struct DFAPair {
+    FlatDFA a;
+    FlatDFA b;
+    std::string alphabet;
+    std::vector<size_t> column_a;
+    std::vector<size_t> column_b;
+
+    DFAPair(const DFA &dfa_a, const DFA &dfa_b) : a(FlatDFA::from_api(dfa_a)), b(FlatDFA::from_api(dfa_b)) {
+        std::set<char> symbols(a.alphabet.begin(), a.alphabet.end());
+        symbols.insert(b.alphabet.begin(), b.alphabet.end());
+        alphabet.assign(symbols.begin(), symbols.end());
+        for (char sym: alphabet) {
+            column_a.push_back(a.alphabet.find(sym));
+            column_b.push_back(b.alphabet.find(sym));
+        }
+    }
+
+    uint32_t step_a(uint32_t p, size_t sym) const {
+        return p == FlatDFA::NONE or column_a[sym] == std::string::npos ? FlatDFA::NONE : a.get_trans(p, column_a[sym]);
+    }
+
+    uint32_t step_b(uint32_t q, size_t sym) const {
+        return q == FlatDFA::NONE or column_b[sym] == std::string::npos ? FlatDFA::NONE : b.get_trans(q, column_b[sym]);
+    }
+
+    bool final_a(uint32_t p) const {
+        return p != FlatDFA::NONE and a.final[p];
+    }
+
+    bool final_b(uint32_t q) const {
+        return q != FlatDFA::NONE and b.final[q];
+    }
+};
+
+// A pair of states reached by one symbol from an earlier entry of the same search queue.
+struct PairStep {
+    uint32_t p;
+    uint32_t q;
+    size_t parent;
+    char sym;
+};
+
+std::string word_to(const std::vector<PairStep> &queue, size_t i) {
+    std::string word;
+    for (; queue[i].parent != size_t(-1); i = queue[i].parent) {
+        word += queue[i].sym;
+    }
+    std::reverse(word.begin(), word.end());
+    return word;
 }
 
+// Hopcroft–Karp: every reached pair is united in a union-find over the states of both automata,
+// and a pair already in one set is not looked at again, so equal languages cost near-linear
+// time. Stops at the first pair that disagrees on acceptance; the word leading to it is left in
+// `counterexample` (empty when the languages are equal).
+bool equivalent(const DFA &a, const DFA &b, std::string &counterexample) {
+    const DFAPair pair(a, b);
+    const size_t dead_a = pair.a.size() + pair.b.size();
+    auto id_a = [&](uint32_t p) {
+        return p == FlatDFA::NONE ? dead_a : size_t(p);
+    };
+    auto id_b = [&](uint32_t q) {
+        return q == FlatDFA::NONE ? dead_a + 1 : pair.a.size() + q;
+    };
 
-DFA dfa_minim(DFA &d) {
-    auto pairs = get_state_equ_pairs(d);
-    std::cout << "get_state_equ_pairs" << std::endl;
-    auto groups = merge_into_groups(pairs, d);
-    std::cout << "merge_into_groups" << std::endl;
-    auto minim_dfa = build_dfa(groups, d);
-    std::cout << "build_dfa" << std::endl;
-    delete_unattainable(minim_dfa);
-    minim_dfa.delete_state(DEAD_NAME);
-    return minim_dfa;
+    UnionFind sets(dead_a + 2);
+    std::vector<PairStep> queue = {{pair.a.initial, pair.b.initial, size_t(-1), 0}};
+    sets.unite(id_a(pair.a.initial), id_b(pair.b.initial));
+    for (size_t i = 0; i < queue.size(); i++) {
+        const PairStep step = queue[i];
+        if (pair.final_a(step.p) != pair.final_b(step.q)) {
+            FLA_COUNT("equivalent.pairs_compared", i + 1);
+            counterexample = word_to(queue, i);
+            return false;
+        }
+        for (size_t sym = 0; sym < pair.alphabet.size(); sym++) {
+            const uint32_t p = pair.step_a(step.p, sym);
+            const uint32_t q = pair.step_b(step.q, sym);
+            if (sets.find(id_a(p)) != sets.find(id_b(q))) {
+                sets.unite(id_a(p), id_b(q));
+                queue.push_back({p, q, i, pair.alphabet[sym]});
+            }
+        }
+    }
+    FLA_COUNT("equivalent.pairs_compared", queue.size());
+    counterexample.clear();
+    return true;
+}
+
+bool equivalent(const DFA &a, const DFA &b) {
+    std::string counterexample;
+    return equivalent(a, b, counterexample);
+}
+
+// L(a) ⊆ L(b), by breadth-first search of the product automaton; pairs whose a side is dead
+// accept nothing and are not expanded. On failure `counterexample` holds a shortest word of
+// L(a) that b rejects.
+bool included(const DFA &a, const DFA &b, std::string &counterexample) {
+    const DFAPair pair(a, b);
+    std::unordered_set<uint64_t> visited;
+    auto key = [](uint32_t p, uint32_t q) {
+        return uint64_t(p) << 32 | q;
+    };
+
+    std::vector<PairStep> queue;
+    if (pair.a.initial != FlatDFA::NONE) {
+        queue.push_back({pair.a.initial, pair.b.initial, size_t(-1), 0});
+        visited.insert(key(pair.a.initial, pair.b.initial));
+    }
+    for (size_t i = 0; i < queue.size(); i++) {
+        const PairStep step = queue[i];
+        if (pair.final_a(step.p) and !pair.final_b(step.q)) {
+            FLA_COUNT("included.pairs_compared", i + 1);
+            counterexample = word_to(queue, i);
+            return false;
+        }
+        for (size_t sym = 0; sym < pair.alphabet.size(); sym++) {
+            const uint32_t p = pair.step_a(step.p, sym);
+            const uint32_t q = pair.step_b(step.q, sym);
+            if (p != FlatDFA::NONE and visited.insert(key(p, q)).second) {
+                queue.push_back({p, q, i, pair.alphabet[sym]});
+            }
+        }
+    }
+    FLA_COUNT("included.pairs_compared", queue.size());
+    counterexample.clear();
+    return true;
+}
+
+bool included(const DFA &a, const DFA &b) {
+    std::string counterexample;
+    return included(a, b, counterexample);
 }
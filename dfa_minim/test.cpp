@@ -0,0 +1,283 @@
+// Differential test for dfa_minim. Build it next to task.cpp, against the same api.hpp:
+//
+//   g++ -std=c++17 -O2 -pthread test.cpp -o test && ./test [--cases 1000] [--seed 1]
+//
+// Random and structured DFAs go through every engine (hopcroft, valmari_lehtinen,
+// parallel_moore, the pairwise reference and IncrementalMinimizer), and the canonical forms of
+// the results must match. The incremental minimizer is also checked after random edits against
+// hopcroft on the edited automaton, and toggling one edge many times must keep the cost of an
+// update flat. Prints one line per failure and exits with 1 if there was any.
+#include "task.cpp"
+#include "../common/fla.hpp"
+#include <chrono>
+#include <cstdio>
+#include <random>
+
+// States renumbered in breadth-first order from the initial state, symbols in alphabet order;
+// names are kept, as every engine names a class after its members.
+std::string canonical(const DFA &dfa) {
+    const FlatDFA flat = FlatDFA::from_api(dfa);
+    if (flat.initial == FlatDFA::NONE) {
+        return "empty";
+    }
+    std::vector<uint32_t> order = {flat.initial};
+    std::vector<uint32_t> number(flat.size(), FlatDFA::NONE);
+    number[flat.initial] = 0;
+    for (size_t i = 0; i < order.size(); i++) {
+        for (size_t a = 0; a < flat.width(); a++) {
+            const uint32_t to = flat.get_trans(order[i], a);
+            if (to != FlatDFA::NONE and number[to] == FlatDFA::NONE) {
+                number[to] = uint32_t(order.size());
+                order.push_back(to);
+            }
+        }
+    }
+    std::ostringstream out;
+    out << flat.alphabet << ";";
+    for (uint32_t s: order) {
+        out << flat.names[s] << (flat.final[s] ? "*" : "") << ":";
+        for (size_t a = 0; a < flat.width(); a++) {
+            const uint32_t to = flat.get_trans(s, a);
+            out << (to == FlatDFA::NONE ? std::string("-") : std::to_string(number[to])) << ",";
+        }
+        out << ";";
+    }
+    return out.str() + (order.size() == flat.size() ? "" : " unreachable");
+}
+
+// Up to `n` states, each transition present with probability `density`, some states final and
+// some unreachable.
+FlatDFA random_dfa(size_t n, const std::string &alphabet, double density, std::mt19937_64 &rng) {
+    std::uniform_real_distribution<double> coin(0, 1);
+    FlatDFA dfa(alphabet);
+    for (size_t s = 0; s < n; s++) {
+        dfa.add_state("q" + std::to_string(s), coin(rng) < 0.3);
+    }
+    for (uint32_t s = 0; s < n; s++) {
+        for (size_t a = 0; a < alphabet.size(); a++) {
+            if (coin(rng) < density) {
+                dfa.set_trans(s, a, uint32_t(rng() % n));
+            }
+        }
+    }
+    dfa.initial = n == 0 ? FlatDFA::NONE : uint32_t(rng() % n);
+    return dfa;
+}
+
+// `copies` copies of a random core, each transition going to the right core state in a random
+// copy, so whole copies collapse onto the core.
+FlatDFA copies_dfa(size_t core_size, size_t copies, const std::string &alphabet, std::mt19937_64 &rng) {
+    const FlatDFA core = random_dfa(core_size, alphabet, 1.0, rng);
+    FlatDFA dfa(alphabet);
+    for (size_t s = 0; s < core_size * copies; s++) {
+        dfa.add_state("q" + std::to_string(s), core.final[s % core_size]);
+    }
+    for (uint32_t s = 0; s < dfa.size(); s++) {
+        for (size_t a = 0; a < alphabet.size(); a++) {
+            const uint32_t to = core.get_trans(uint32_t(s % core_size), a);
+            dfa.set_trans(s, a, uint32_t(to + core_size * (rng() % copies)));
+        }
+    }
+    dfa.initial = 0;
+    return dfa;
+}
+
+// A chain on the first symbol, final every `period` states, with the other symbols looping
+// back to the start: states at the same offset in the period are equivalent only if the chain
+// closes into a cycle.
+FlatDFA chain_dfa(size_t n, size_t period, bool cycle, const std::string &alphabet) {
+    FlatDFA dfa(alphabet);
+    for (size_t s = 0; s < n; s++) {
+        dfa.add_state("q" + std::to_string(s), s % period == period - 1);
+    }
+    for (uint32_t s = 0; s < n; s++) {
+        if (s + 1 < n or cycle) {
+            dfa.set_trans(s, 0, uint32_t((s + 1) % n));
+        }
+        for (size_t a = 1; a < alphabet.size(); a++) {
+            dfa.set_trans(s, a, 0);
+        }
+    }
+    dfa.initial = 0;
+    return dfa;
+}
+
+// The api DFA of `flat` without the deleted states and the transitions into them.
+DFA without_deleted(const FlatDFA &flat, const std::vector<bool> &deleted) {
+    DFA dfa = DFA(Alphabet(flat.alphabet));
+    for (uint32_t s = 0; s < flat.size(); s++) {
+        if (!deleted[s]) {
+            dfa.create_state(flat.names[s], flat.final[s]);
+        }
+    }
+    for (uint32_t s = 0; s < flat.size(); s++) {
+        for (size_t a = 0; a < flat.width(); a++) {
+            const uint32_t to = flat.get_trans(s, a);
+            if (!deleted[s] and to != FlatDFA::NONE and !deleted[to]) {
+                dfa.set_trans(flat.names[s], flat.alphabet[a], flat.names[to]);
+            }
+        }
+    }
+    if (flat.initial != FlatDFA::NONE and !deleted[flat.initial]) {
+        dfa.set_initial(flat.names[flat.initial]);
+    }
+    return dfa;
+}
+
+size_t failures = 0;
+
+void check(const std::string &label, const DFA &input, const DFA &expected, const DFA &actual) {
+    if (canonical(expected) != canonical(actual)) {
+        failures++;
+        std::printf("%s: %s expected %s, got %s\n", label.c_str(), canonical(input).c_str(),
+                    canonical(expected).c_str(), canonical(actual).c_str());
+    }
+}
+
+void check_engines(const std::string &label, const FlatDFA &flat) {
+    DFA input = flat.to_api();
+    const DFA expected = dfa_minim(input, hopcroft);
+    check(label + "/valmari_lehtinen", input, expected, dfa_minim(input, valmari_lehtinen));
+    check(label + "/parallel_moore", input, expected, dfa_minim(input, parallel_moore, 3));
+    check(label + "/reference", input, expected, dfa_minim_reference(input));
+    check(label + "/incremental", input, expected, IncrementalMinimizer(input).minimal());
+}
+
+// Random edits applied to an IncrementalMinimizer and to a copy of the automaton, with an
+// update() after every few.
+void check_edits(const std::string &label, const FlatDFA &flat, std::mt19937_64 &rng) {
+    IncrementalMinimizer minimizer(flat.to_api());
+    FlatDFA mirror = flat;
+    std::vector<bool> deleted(flat.size(), false);
+    for (int round = 0; round < 20; round++) {
+        for (size_t edit = 1 + rng() % 3; edit > 0; edit--) {
+            const uint32_t s = uint32_t(rng() % mirror.size());
+            const uint32_t t = uint32_t(rng() % mirror.size());
+            const size_t a = rng() % mirror.width();
+            const std::string &name = mirror.names[s];
+            switch (rng() % 10) {
+                case 0:
+                    minimizer.delete_state(name);
+                    if (!deleted[s]) {
+                        deleted[s] = true;
+                        mirror.initial = mirror.initial == s ? FlatDFA::NONE : mirror.initial;
+                    }
+                    break;
+                case 1: {
+                    const std::string added = "n" + std::to_string(mirror.size());
+                    const bool is_final = rng() % 2 == 0;
+                    minimizer.add_state(added, is_final);
+                    mirror.add_state(added, is_final);
+                    deleted.push_back(false);
+                    break;
+                }
+                case 2:
+                    if (!deleted[s]) {
+                        minimizer.set_initial(name);
+                        mirror.initial = s;
+                    }
+                    break;
+                case 3:
+                case 4:
+                    if (!deleted[s]) {
+                        minimizer.set_final(name, !mirror.final[s]);
+                        mirror.final[s] = !mirror.final[s];
+                    }
+                    break;
+                case 5:
+                    if (!deleted[s]) {
+                        minimizer.remove_trans(name, mirror.alphabet[a]);
+                        mirror.set_trans(s, a, FlatDFA::NONE);
+                    }
+                    break;
+                default:
+                    if (!deleted[s] and !deleted[t]) {
+                        minimizer.set_trans(name, mirror.alphabet[a], mirror.names[t]);
+                        mirror.set_trans(s, a, t);
+                    }
+                    break;
+            }
+        }
+        minimizer.update();
+        DFA input = without_deleted(mirror, deleted);
+        check(label + "/edits", input, dfa_minim(input, hopcroft), minimizer.minimal());
+    }
+}
+
+// Toggles q1 -b-> q0 on and off in a long chain, with an update() after each. Only q0 and q1 can
+// reach the edit, so the time per update must not grow with the number of toggles before it.
+void check_toggles() {
+    const size_t n = 2000;
+    const size_t batch = 2000;
+    FlatDFA chain("ab");
+    for (size_t s = 0; s < n; s++) {
+        chain.add_state("q" + std::to_string(s), s + 1 == n);
+    }
+    for (uint32_t s = 0; s + 1 < n; s++) {
+        chain.set_trans(s, 0, s + 1);
+    }
+    chain.initial = 0;
+    IncrementalMinimizer minimizer(chain.to_api());
+    auto toggle = [&](size_t count) {
+        const auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < count; i++) {
+            if (i % 2 == 0) {
+                minimizer.set_trans("q1", 'b', "q0");
+            } else {
+                minimizer.remove_trans("q1", 'b');
+            }
+            minimizer.update();
+        }
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    };
+    const double early = toggle(batch);
+    toggle(50 * batch);
+    const double late = toggle(batch);
+    DFA input = chain.to_api();
+    check("toggles", input, dfa_minim(input, hopcroft), minimizer.minimal());
+    if (late > 3 * early + 5) {
+        failures++;
+        std::printf("toggles: %zu updates took %.1f ms at first and %.1f ms after %zu more\n", batch, early, late,
+                    50 * batch);
+    }
+}
+
+int main(int argc, char **argv) {
+    size_t cases = 1000;
+    uint64_t seed = 1;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        const std::string flag = argv[i];
+        if (flag == "--cases") {
+            cases = std::stoul(argv[i + 1]);
+        } else if (flag == "--seed") {
+            seed = std::stoull(argv[i + 1]);
+        } else {
+            std::fprintf(stderr, "unknown option %s\n", flag.c_str());
+            return 2;
+        }
+    }
+
+    std::mt19937_64 rng(seed);
+    const std::string alphabets[] = {"a", "ab", "abc"};
+    for (size_t i = 0; i < cases; i++) {
+        const std::string &alphabet = alphabets[i % 3];
+        const std::string label = "case " + std::to_string(i);
+        const FlatDFA flat = random_dfa(1 + rng() % 12, alphabet, i % 2 ? 1.0 : 0.7, rng);
+        check_engines(label + "/random", flat);
+        check_engines(label + "/copies", copies_dfa(1 + rng() % 5, 2 + rng() % 3, alphabet, rng));
+        check_edits(label, flat, rng);
+    }
+    for (size_t n = 1; n <= 40; n++) {
+        for (size_t period = 1; period <= 4; period++) {
+            for (bool cycle: {false, true}) {
+                const std::string label = "chain " + std::to_string(n) + "/" + std::to_string(period);
+                check_engines(label, chain_dfa(n, period, cycle, "ab"));
+            }
+        }
+    }
+    check_engines("no states", FlatDFA("ab"));
+    check_toggles();
+
+    std::printf("%zu failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}
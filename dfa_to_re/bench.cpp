@@ -0,0 +1,167 @@
+// Elimination-order benchmark for dfa2re. Build it next to task.cpp, against the same api.hpp:
+//
+//   g++ -std=c++17 -O2 -pthread bench.cpp -o bench
+//   ./bench [--sizes 10,20,...] [--generators random,sparse] [--heuristics min_degree,...]
+//           [--alphabet 2] [--seed 1] [--timeout 60]
+//
+// Prints a JSON array with one record per (generator, size, heuristic): wall time, length of the
+// regex, peak RSS and the elimination order. Each case runs in a forked child, and a case still
+// running after --timeout seconds is killed and reported with "timed_out": true (the regex can
+// grow exponentially with a bad order).
+#include "task.cpp"
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <csignal>
+#include <sstream>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+struct BenchConfig {
+    std::vector<size_t> sizes = {10, 20, 40, 80, 160};
+    std::vector<std::string> generators = {"random", "sparse"};
+    std::vector<std::string> heuristics = {"min_degree", "delgado_morais"};
+    size_t alphabet = 2;
+    uint64_t seed = 1;
+    unsigned timeout = 60;
+};
+
+std::string bench_alphabet(size_t size) {
+    const std::string symbols = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    return symbols.substr(0, std::max<size_t>(std::min(size, symbols.size()), 1));
+}
+
+// Uniform targets, about a third of the states final. The first symbol always has a transition,
+// the others with probability `density`.
+FlatDFA random_dfa(size_t n, const std::string &alphabet, double density, std::mt19937_64 &rng) {
+    FlatDFA dfa(alphabet);
+    for (size_t s = 0; s < n; s++) {
+        dfa.add_state("q" + std::to_string(s), rng() % 3 == 0);
+    }
+    std::uniform_real_distribution<double> coin(0, 1);
+    for (uint32_t s = 0; s < n; s++) {
+        for (size_t a = 0; a < alphabet.size(); a++) {
+            if (a == 0 or coin(rng) < density) {
+                dfa.set_trans(s, a, uint32_t(rng() % n));
+            }
+        }
+    }
+    dfa.initial = 0;
+    return dfa;
+}
+
+FlatDFA generate(const std::string &generator, size_t n, const std::string &alphabet, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    return random_dfa(n, alphabet, generator == "sparse" ? 0.5 : 1.0, rng);
+}
+
+std::string run_case(const BenchConfig &config, const std::string &generator, size_t n,
+                     const std::string &heuristic) {
+    DFA input = generate(generator, n, bench_alphabet(config.alphabet), config.seed).to_api();
+    std::vector<std::string> order;
+    const auto start = std::chrono::steady_clock::now();
+    const std::string regex = dfa2re(input, heuristic == "delgado_morais" ? delgado_morais : min_degree, order);
+    const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    std::ostringstream out;
+    out << "  {\"generator\": \"" << generator << "\", \"states\": " << n << ", \"alphabet\": " << config.alphabet
+        << ", \"seed\": " << config.seed << ", \"heuristic\": \"" << heuristic << "\", \"ms\": " << ms
+        << ", \"regex_length\": " << regex.size() << ", \"peak_rss_kb\": " << usage.ru_maxrss << ", \"order\": [";
+    for (size_t i = 0; i < order.size(); i++) {
+        out << (i ? ", " : "") << "\"" << order[i] << "\"";
+    }
+    out << "]}";
+    return out.str();
+}
+
+// Runs the case in a child process and returns its record, or "" if the child failed.
+std::string run_isolated(const BenchConfig &config, const std::string &generator, size_t n,
+                         const std::string &heuristic) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return "";
+    }
+    const pid_t child = fork();
+    if (child == 0) {
+        close(fds[0]);
+        alarm(config.timeout);
+        const std::string record = run_case(config, generator, n, heuristic);
+        const bool written = write(fds[1], record.data(), record.size()) == ssize_t(record.size());
+        std::_Exit(written ? 0 : 1);
+    }
+    close(fds[1]);
+    std::string record;
+    char buffer[4096];
+    ssize_t got;
+    while ((got = read(fds[0], buffer, sizeof(buffer))) > 0) {
+        record.append(buffer, size_t(got));
+    }
+    close(fds[0]);
+    int status = 0;
+    waitpid(child, &status, 0);
+    if (child > 0 and WIFSIGNALED(status) and WTERMSIG(status) == SIGALRM) {
+        std::ostringstream out;
+        out << "  {\"generator\": \"" << generator << "\", \"states\": " << n << ", \"heuristic\": \"" << heuristic
+            << "\", \"timed_out\": true, \"timeout_s\": " << config.timeout << "}";
+        return out.str();
+    }
+    return child > 0 and WIFEXITED(status) and WEXITSTATUS(status) == 0 ? record : "";
+}
+
+template<class T, class F>
+std::vector<T> split_list(const std::string &list, const F &convert) {
+    std::vector<T> items;
+    std::stringstream in(list);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        if (!item.empty()) {
+            items.push_back(convert(item));
+        }
+    }
+    return items;
+}
+
+int main(int argc, char **argv) {
+    BenchConfig config;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        const std::string flag = argv[i];
+        const std::string value = argv[i + 1];
+        if (flag == "--sizes") {
+            config.sizes = split_list<size_t>(value, [](const std::string &s) { return size_t(std::stoull(s)); });
+        } else if (flag == "--generators") {
+            config.generators = split_list<std::string>(value, [](const std::string &s) { return s; });
+        } else if (flag == "--heuristics") {
+            config.heuristics = split_list<std::string>(value, [](const std::string &s) { return s; });
+        } else if (flag == "--alphabet") {
+            config.alphabet = std::stoul(value);
+        } else if (flag == "--seed") {
+            config.seed = std::stoull(value);
+        } else if (flag == "--timeout") {
+            config.timeout = unsigned(std::stoul(value));
+        } else {
+            std::fprintf(stderr, "unknown option %s\n", flag.c_str());
+            return 2;
+        }
+    }
+
+    std::printf("[\n");
+    bool first = true;
+    for (const auto &generator: config.generators) {
+        for (size_t n: config.sizes) {
+            for (const auto &heuristic: config.heuristics) {
+                const std::string record = run_isolated(config, generator, n, heuristic);
+                if (record.empty()) {
+                    std::fprintf(stderr, "%s/%zu/%s failed\n", generator.c_str(), n, heuristic.c_str());
+                    continue;
+                }
+                std::printf("%s%s", first ? "" : ",\n", record.c_str());
+                std::fflush(stdout);
+                first = false;
+            }
+        }
+    }
+    std::printf("\n]\n");
+    return 0;
+}
@@ -1,14 +1,19 @@
 #include "api.hpp"
+#include "../common/fla.hpp"
 #include <string>
 #include <vector>
 #include <iostream>
 #include <map>
 #include <fstream>
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <stdexcept>
 
 const std::string EPS = "@";
 
-typedef std::map<std::string, std::map<std::string, std::vector<std::string>>> RawTransitionTable;
-typedef std::map<std::string, std::map<std::string, std::string>> TransitionTable;
+typedef uint32_t RegexId;
+typedef std::vector<std::map<uint32_t, std::vector<std::string>>> RawTransitionTable;
 
 template<class T, class E>
 bool is_in(const E &element, const T &container) {
@@ -21,100 +26,515 @@ bool is_in(const T &element, const std::vector<T> &container) {
 }
 
 
-bool only_eps(const std::vector<std::string> &regs) {
-    for (const auto &reg: regs) {
-        if (reg != EPS) {
+// Regular expressions as a hash-consed DAG: every distinct node is stored once and named by its
+// id, so equal subterms are shared. The constructors simplify as they build, keeping the language:
+//   union:  r|r = r, ∅|r = r, nested unions are flattened and operands kept in structural order
+//           (see before(), so equal sets of operands give one node and print the same however
+//           they were built), r is dropped next to r* and eps next to any
+//           nullable operand, and a common first or last factor is pulled out (xr|xs = x(r|s))
+//           where that shortens the printed form;
+//   concat: ∅r = ∅, eps r = r, nested concatenations are flattened, r*r* = r*;
+//   star:   ∅* = eps* = eps, (r*)* = r*, (eps|r|s*)* = (r|s)*, and (rs)* = (r|s)* for nullable r, s.
+// Only to_string() builds the printed form: "@" for eps, "(x|y|...)" for a union (bare at the top),
+// operands side by side for a concatenation, "x*" for a symbol or a union and "(x)*" otherwise.
+class RegexDAG {
+public:
+    static const RegexId EMPTY = 0;
+    static const RegexId EPSILON = 1;
+
+    RegexDAG() {
+        intern(empty_set, "", {});
+        intern(eps, EPS, {});
+    }
+
+    size_t size() const {
+        return nodes.size();
+    }
+
+    RegexId symbol(char sym) {
+        return intern(leaf, std::string(1, sym), {});
+    }
+
+    RegexId either(const std::vector<RegexId> &parts) {
+        std::vector<RegexId> operands;
+        for (RegexId part: parts) {
+            if (nodes[part].kind == alternation) {
+                operands.insert(operands.end(), nodes[part].operands.begin(), nodes[part].operands.end());
+            } else if (part != EMPTY) {
+                operands.push_back(part);
+            }
+        }
+        std::sort(operands.begin(), operands.end(), [this](RegexId a, RegexId b) { return before(a, b); });
+        operands.erase(std::unique(operands.begin(), operands.end()), operands.end());
+
+        std::set<RegexId> redundant;
+        for (RegexId operand: operands) {
+            if (nodes[operand].kind == kleene) {
+                redundant.insert(nodes[operand].operands[0]);
+            }
+            if (operand != EPSILON and nodes[operand].nullable) {
+                redundant.insert(EPSILON);
+            }
+        }
+        operands.erase(std::remove_if(operands.begin(), operands.end(), [&](RegexId operand) {
+            return is_in(operand, redundant);
+        }), operands.end());
+
+        if (factor_out(operands, true) or factor_out(operands, false)) {
+            return either(operands);
+        }
+        if (operands.empty()) {
+            return EMPTY;
+        }
+        if (operands.size() == 1) {
+            return operands[0];
+        }
+        return intern(alternation, "", operands);
+    }
+
+    // EMPTY if any part is, EPSILON if all parts are
+    RegexId concat(const std::vector<RegexId> &parts) {
+        std::vector<RegexId> operands;
+        auto append = [&](RegexId operand) {
+            if (operand != EPSILON and !(nodes[operand].kind == kleene and !operands.empty() and
+                                         operands.back() == operand)) {
+                operands.push_back(operand);
+            }
+        };
+        for (RegexId part: parts) {
+            if (part == EMPTY) {
+                return EMPTY;
+            }
+            if (nodes[part].kind == concatenation) {
+                for (RegexId operand: nodes[part].operands) {
+                    append(operand);
+                }
+            } else {
+                append(part);
+            }
+        }
+        if (operands.empty()) {
+            return EPSILON;
+        }
+        if (operands.size() == 1) {
+            return operands[0];
+        }
+        return intern(concatenation, "", operands);
+    }
+
+    RegexId star(RegexId a) {
+        if (a == EMPTY or a == EPSILON) {
+            return EPSILON;
+        }
+        const Kind kind = nodes[a].kind;
+        if (kind == kleene) {
+            return a;
+        }
+        if (kind == alternation or (kind == concatenation and nodes[a].nullable)) {
+            const std::vector<RegexId> parts = nodes[a].operands;
+            std::vector<RegexId> operands;
+            bool changed = kind == concatenation;
+            for (RegexId part: parts) {
+                if (nodes[part].kind == kleene) {
+                    operands.push_back(nodes[part].operands[0]);
+                    changed = true;
+                } else if (part == EPSILON) {
+                    changed = true;
+                } else {
+                    operands.push_back(part);
+                }
+            }
+            if (changed) {
+                return star(either(operands));
+            }
+        }
+        return intern(kleene, "", {a});
+    }
+
+    // length of the printed form, kept exact up to 2^53
+    double length(RegexId id) const {
+        return nodes[id].length;
+    }
+
+    std::string to_string(RegexId id) const {
+        std::string out;
+        print(id, out, true);
+        return out;
+    }
+
+private:
+    enum Kind {
+        empty_set, eps, leaf, alternation, concatenation, kleene
+    };
+
+    struct Node {
+        Kind kind;
+        std::string text;
+        std::vector<RegexId> operands;
+        double length;
+        bool nullable;
+    };
+
+    RegexId intern(Kind kind, const std::string &text, const std::vector<RegexId> &operands) {
+        std::string key(1, char(kind));
+        key += text;
+        for (RegexId operand: operands) {
+            key.append(reinterpret_cast<const char *>(&operand), sizeof(operand));
+        }
+        const auto it = ids.emplace(key, RegexId(nodes.size()));
+        if (it.second) {
+            nodes.push_back(make_node(kind, text, operands));
+        }
+        return it.first->second;
+    }
+
+    Node make_node(Kind kind, const std::string &text, const std::vector<RegexId> &operands) const {
+        Node node = {kind, text, operands, double(text.size()), kind == eps or kind == kleene or kind == concatenation};
+        for (RegexId operand: operands) {
+            node.length += nodes[operand].length;
+            if (kind == alternation) {
+                node.nullable = node.nullable or nodes[operand].nullable;
+            } else if (kind == concatenation) {
+                node.nullable = node.nullable and nodes[operand].nullable;
+            }
+        }
+        if (kind == alternation) {
+            node.length += double(operands.size() + 1);
+        } else if (kind == kleene) {
+            node.length += starred_bare(operands[0]) ? 1 : 3;
+        }
+        return node;
+    }
+
+    // Operands of a union that share their first (or last) factor x are replaced by x(r|s|...)
+    // (or (r|s|...)x) when that prints shorter; returns true if anything was replaced. The length
+    // is bounded from the operands alone, so a rejected group adds no nodes.
+    bool factor_out(std::vector<RegexId> &operands, bool prefix) {
+        std::vector<RegexId> factors;
+        std::unordered_map<RegexId, std::vector<RegexId>> groups;
+        for (RegexId operand: operands) {
+            auto &group = groups[end_factor(operand, prefix)];
+            if (group.empty()) {
+                factors.push_back(end_factor(operand, prefix));
+            }
+            group.push_back(operand);
+        }
+        bool changed = false;
+        for (RegexId factor: factors) {
+            const std::vector<RegexId> &group = groups[factor];
+            if (group.size() < 2) {
+                continue;
+            }
+            double length = double(group.size() - 1);
+            double factored_length = nodes[factor].length + double(group.size() + 1);
+            for (RegexId operand: group) {
+                length += nodes[operand].length;
+                factored_length += rest_length(operand, prefix);
+            }
+            if (factored_length >= length) {
+                continue;
+            }
+            std::vector<RegexId> rests;
+            for (RegexId operand: group) {
+                rests.push_back(rest(operand, prefix));
+            }
+            const RegexId common = either(rests);
+            operands.erase(std::remove_if(operands.begin(), operands.end(), [&](RegexId operand) {
+                return is_in(operand, group);
+            }), operands.end());
+            operands.push_back(prefix ? concat({factor, common}) : concat({common, factor}));
+            changed = true;
+        }
+        return changed;
+    }
+
+    RegexId end_factor(RegexId id, bool first) const {
+        if (nodes[id].kind != concatenation) {
+            return id;
+        }
+        return first ? nodes[id].operands.front() : nodes[id].operands.back();
+    }
+
+    // printed length of rest(id, first) as an operand of a union, which drops the parentheses
+    // of a nested union; the simplified union of the rests is never longer than their sum
+    double rest_length(RegexId id, bool first) const {
+        const Node &node = nodes[id];
+        if (node.kind != concatenation) {
+            return nodes[EPSILON].length;
+        }
+        const RegexId end = first ? node.operands.front() : node.operands.back();
+        const RegexId other = first ? node.operands.back() : node.operands.front();
+        const bool bare_union = node.operands.size() == 2 and nodes[other].kind == alternation;
+        return node.length - nodes[end].length - (bare_union ? 2 : 0);
+    }
+
+    // structural order: by kind, then symbol, then operands in turn; equal structure means
+    // equal id, so shared subterms end the comparison at once
+    bool before(RegexId a, RegexId b) const {
+        if (a == b) {
             return false;
         }
+        const Node &x = nodes[a];
+        const Node &y = nodes[b];
+        if (x.kind != y.kind) {
+            return x.kind < y.kind;
+        }
+        if (x.text != y.text) {
+            return x.text < y.text;
+        }
+        for (size_t i = 0; i < x.operands.size() and i < y.operands.size(); i++) {
+            if (x.operands[i] != y.operands[i]) {
+                return before(x.operands[i], y.operands[i]);
+            }
+        }
+        return x.operands.size() < y.operands.size();
     }
-    return true;
-}
 
-std::string star(const std::string &reg){
-    if (reg.length() == 1)
-        return reg + "*";
-    else
-        return "(" + reg + ")*";
-}
+    // `id` without its end_factor
+    RegexId rest(RegexId id, bool first) {
+        if (nodes[id].kind != concatenation) {
+            return EPSILON;
+        }
+        std::vector<RegexId> operands = nodes[id].operands;
+        if (first) {
+            operands.erase(operands.begin());
+        } else {
+            operands.pop_back();
+        }
+        return concat(operands);
+    }
 
-std::string concat(const std::vector<std::string> &regs) {
+    // printed as a single character or already parenthesised, so a star needs no group
+    bool starred_bare(RegexId id) const {
+        return nodes[id].kind == eps or nodes[id].kind == leaf or nodes[id].kind == alternation;
+    }
 
-    if (std::find(regs.begin(), regs.end(), "") != regs.end()) {
-        return "";
-    } else if (only_eps(regs)) {
-        return EPS;
-    } else {
-        std::string res = "";
-        for (const auto &reg: regs) {
-            if (reg != EPS)
-                res += reg;
+    void print(RegexId id, std::string &out, bool top) const {
+        const Node &node = nodes[id];
+        switch (node.kind) {
+            case empty_set:
+                break;
+            case eps:
+            case leaf:
+                out += node.text;
+                break;
+            case alternation:
+                out += top ? "" : "(";
+                for (size_t i = 0; i < node.operands.size(); i++) {
+                    out += i ? "|" : "";
+                    print(node.operands[i], out, false);
+                }
+                out += top ? "" : ")";
+                break;
+            case concatenation:
+                for (RegexId operand: node.operands) {
+                    print(operand, out, false);
+                }
+                break;
+            case kleene:
+                if (starred_bare(node.operands[0])) {
+                    print(node.operands[0], out, false);
+                    out += "*";
+                } else {
+                    out += "(";
+                    print(node.operands[0], out, false);
+                    out += ")*";
+                }
+                break;
         }
-        return res;
     }
-}
 
-TransitionTable get_transition_table(const DFA &dfa) {
-    RawTransitionTable table;
+    std::vector<Node> nodes;
+    std::unordered_map<std::string, RegexId> ids;
+};
+
+const RegexId RegexDAG::EMPTY;
+const RegexId RegexDAG::EPSILON;
+
+// Sparse edges of the elimination graph: the labelled successors and the predecessors of every
+// state. Missing edges read as EMPTY, and setting an edge to EMPTY removes it.
+class TransitionTable {
+public:
+    TransitionTable() = default;
+
+    explicit TransitionTable(size_t states) : out(states), in(states) {}
+
+    RegexId get(uint32_t from, uint32_t to) const {
+        const auto it = out[from].find(to);
+        return it == out[from].end() ? RegexDAG::EMPTY : it->second;
+    }
+
+    void set(uint32_t from, uint32_t to, RegexId regex) {
+        if (regex == RegexDAG::EMPTY) {
+            out[from].erase(to);
+            in[to].erase(from);
+        } else {
+            out[from][to] = regex;
+            in[to].insert(from);
+        }
+    }
 
-    auto states = dfa.get_states();
+    const std::map<uint32_t, RegexId> &successors(uint32_t state) const {
+        return out[state];
+    }
 
-    for (const auto &state: states) {
-        for (char sym: dfa.get_alphabet().to_string()) {
-            if (dfa.has_trans(state, sym)) {
-                std::string dst_state = dfa.get_trans(state, sym);
-                table[state][dst_state].push_back(std::string(1, sym));
+    const std::set<uint32_t> &predecessors(uint32_t state) const {
+        return in[state];
+    }
+
+private:
+    std::vector<std::map<uint32_t, RegexId>> out;
+    std::vector<std::set<uint32_t>> in;
+};
+
+// Rows and columns are FlatDFA state ids, followed by INIT (id size()) and FINAL (id size() + 1).
+TransitionTable get_transition_table(const FlatDFA &dfa, RegexDAG &regexes) {
+    const uint32_t init_id = uint32_t(dfa.size());
+    const uint32_t final_id = init_id + 1;
+    RawTransitionTable table(dfa.size() + 2);
+
+    for (uint32_t state = 0; state < dfa.size(); state++) {
+        for (size_t a = 0; a < dfa.width(); a++) {
+            const uint32_t dst_state = dfa.get_trans(state, a);
+            if (dst_state != FlatDFA::NONE) {
+                table[state][dst_state].push_back(std::string(1, dfa.alphabet[a]));
             }
         }
     }
     
-    table["INIT"][dfa.get_initial_state()].push_back(EPS);
-    states.insert("INIT");
-    
+    if (dfa.initial != FlatDFA::NONE) {
+        table[init_id][dfa.initial].push_back(EPS);
+    }
     
-    for (const auto &state: states) {
-        if (is_in(state, dfa.get_final_states())){
-            table[state]["FINAL"].push_back(EPS);
+    for (uint32_t state = 0; state < dfa.size(); state++) {
+        if (dfa.final[state]){
+            table[state][final_id].push_back(EPS);
         }
     }
-    states.insert("FINAL");
     
-    TransitionTable res;
-    for (const auto &state_i: states) {
-        for (const auto &state_j: states) {
-            if (table[state_i][state_j].size() == 0) {
-                res[state_i][state_j] = "";
-            } else if (table[state_i][state_j].size() == 1) {
-                res[state_i][state_j] = table[state_i][state_j][0];
-            } else {
-                res[state_i][state_j] = table[state_i][state_j][0];
-                for (int i = 1; i < table[state_i][state_j].size(); i++) {
-                    res[state_i][state_j] += "|" + table[state_i][state_j][i];
-                }
-                res[state_i][state_j] = "(" + res[state_i][state_j] + ")";
+    TransitionTable res(table.size());
+    for (uint32_t state_i = 0; state_i < table.size(); state_i++) {
+        for (const auto &cell: table[state_i]) {
+            std::vector<RegexId> syms;
+            for (const auto &sym: cell.second) {
+                syms.push_back(sym == EPS ? RegexDAG::EPSILON : regexes.symbol(sym[0]));
             }
+            res.set(state_i, cell.first, regexes.either(syms));
         }
     }
     return res;
 }
 
-struct MDFA {
+// How delete_intermediate_states picks the next state: fewest incident edges (a self-loop
+// counts twice, as in the original scan), or the Delgado–Morais weight, i.e. by how much the
+// total length of the labels grows when the state is eliminated.
+enum EliminationHeuristic {
+    min_degree, delgado_morais
+};
+
+// Binary min-heap of states whose keys can change while they are queued; equal keys go to the
+// larger state id first.
+class EliminationQueue {
 public:
-    explicit MDFA(const DFA &dfa) {
-        table = get_transition_table(dfa);
-//        init_state = dfa.get_initial_state();
-        init_state = "INIT";
-//        final_states = dfa.get_final_states();
-        final_states = std::set<std::string>({"FINAL"});
-        active_states = dfa.get_states();
-        active_states.insert("INIT");
-        active_states.insert("FINAL");
+    static const uint32_t NONE = FlatDFA::NONE;
+
+    void reset(size_t states) {
+        heap.clear();
+        position.assign(states, NONE);
+        key.assign(states, 0);
+    }
+
+    bool empty() const {
+        return heap.empty();
+    }
+
+    bool contains(uint32_t state) const {
+        return state < position.size() and position[state] != NONE;
+    }
+
+    void push(uint32_t state, double priority) {
+        key[state] = priority;
+        heap.push_back(state);
+        sift_up(heap.size() - 1);
+    }
+
+    void update(uint32_t state, double priority) {
+        key[state] = priority;
+        sift_up(position[state]);
+        sift_down(position[state]);
+    }
+
+    uint32_t pop() {
+        const uint32_t top = heap[0];
+        position[top] = NONE;
+        const uint32_t last = heap.back();
+        heap.pop_back();
+        if (!heap.empty()) {
+            heap[0] = last;
+            sift_down(0);
+        }
+        return top;
+    }
+
+private:
+    bool before(uint32_t a, uint32_t b) const {
+        return key[a] < key[b] or (key[a] == key[b] and a > b);
+    }
+
+    void place(size_t i, uint32_t state) {
+        heap[i] = state;
+        position[state] = uint32_t(i);
+    }
+
+    void sift_up(size_t i) {
+        const uint32_t state = heap[i];
+        while (i > 0 and before(state, heap[(i - 1) / 2])) {
+            place(i, heap[(i - 1) / 2]);
+            i = (i - 1) / 2;
+        }
+        place(i, state);
+    }
+
+    void sift_down(size_t i) {
+        const uint32_t state = heap[i];
+        while (2 * i + 1 < heap.size()) {
+            size_t child = 2 * i + 1;
+            if (child + 1 < heap.size() and before(heap[child + 1], heap[child])) {
+                child++;
+            }
+            if (!before(heap[child], state)) {
+                break;
+            }
+            place(i, heap[child]);
+            i = child;
+        }
+        place(i, state);
     }
 
-    MDFA(const MDFA &mdfa, const std::string &final_state) {
-        table = mdfa.table;
-        init_state = mdfa.init_state;
-        final_states = {final_state};
-        active_states = mdfa.active_states;
+    std::vector<uint32_t> heap;
+    std::vector<uint32_t> position;
+    std::vector<double> key;
+};
+
+const uint32_t EliminationQueue::NONE;
+
+struct MDFA {
+public:
+    explicit MDFA(const FlatDFA &dfa) : names(dfa.names) {
+        table = get_transition_table(dfa, regexes);
+        init_state = uint32_t(dfa.size());
+        final_state = init_state + 1;
+        names.push_back("INIT");
+        names.push_back("FINAL");
+        for (uint32_t state = 0; state < names.size(); state++) {
+            active_states.insert(state);
+        }
+        incidence.resize(names.size());
+        for (uint32_t state = 0; state < names.size(); state++) {
+            for (const auto &edge: table.successors(state)) {
+                account(state, edge.first, edge.second, 1);
+            }
+        }
     }
 
     //$ dot -Tsvg out.gv > out.svg
@@ -123,106 +543,68 @@ public:
         outfile << "digraph G {" << std::endl;
         outfile << "{" << std::endl;
         outfile << "node [style=filled fillcolor=yellow]" << std::endl;
-        outfile << init_state << " []" << std::endl;
+        outfile << names[init_state] << " []" << std::endl;
         outfile << "}" << std::endl;
         outfile << "{" << std::endl;
         outfile << "node []" << std::endl;
-        for (const auto &state: final_states) {
-            outfile << state << " [shape=doublecircle]" << std::endl;
-        }
+        outfile << names[final_state] << " [shape=doublecircle]" << std::endl;
         outfile << "}" << std::endl;
 
         for (const auto &state_i: active_states) {
-            for (const auto &state_j: active_states) {
-                if (table[state_i][state_j] != "") {
-                    outfile << state_i << "->" << state_j << "[ label=\"" << table[state_i][state_j] << "\"];"
-                            << std::endl;
-                }
+            for (const auto &edge: table.successors(state_i)) {
+                outfile << names[state_i] << "->" << names[edge.first] << "[ label=\""
+                        << regexes.to_string(edge.second) << "\"];" << std::endl;
             }
         }
         outfile << "}" << std::endl;
     }
 
-    std::string min_in_out() {
-        std::map<std::string, int> count_in_out;
-        for (const auto &state: active_states) {
-            count_in_out[state] = 0;
-        }
-        int max = 0;
-        for (const auto &state_i: active_states) {
-            for (const auto &state_j: active_states) {
-                if (table[state_i][state_j] != "") {
-                    count_in_out[state_i] += 1;
-                    count_in_out[state_j] += 1;
-                    if (max < count_in_out[state_i])
-                        max = count_in_out[state_i];
-                    if (max < count_in_out[state_j])
-                        max = count_in_out[state_j];
-                }
-            }
-        }
-
-        int min = max + 1;
-        std::string min_state;
-
-        for (auto &state: active_states) {
-            if ((count_in_out[state] <= min) and
-                !(final_states.find(state) != final_states.end()) and
-                (init_state != state)) {
-                min = count_in_out[state];
-                min_state = state;
-            }
-        }
-        return min_state;
-    }
-
-    void delete_state(const std::string &to_rm_state) {
-        std::vector<std::string> in_states;
-        std::vector<std::string> out_states;
-        for (const auto &state: active_states) {
-            if (state == to_rm_state)
-                continue;
-            if (table[state][to_rm_state] != "") {
+    void delete_state(uint32_t to_rm_state) {
+        std::vector<uint32_t> in_states;
+        std::vector<uint32_t> out_states;
+        for (const uint32_t state: table.predecessors(to_rm_state)) {
+            if (state != to_rm_state)
                 in_states.push_back(state);
-            }
-            if (table[to_rm_state][state] != "") {
-                out_states.push_back(state);
-            }
+        }
+        for (const auto &edge: table.successors(to_rm_state)) {
+            if (edge.first != to_rm_state)
+                out_states.push_back(edge.first);
         }
 
-        std::vector<std::string> q;
-        std::vector<std::string> p;
-        std::vector<std::vector<std::string>> R;
-        std::string S;
+        std::vector<RegexId> q;
+        std::vector<RegexId> p;
+        std::vector<std::vector<RegexId>> R;
+        RegexId S;
 
-        q.assign(in_states.size(), "");
-        p.assign(out_states.size(), "");
+        q.assign(in_states.size(), RegexDAG::EMPTY);
+        p.assign(out_states.size(), RegexDAG::EMPTY);
         R.assign(in_states.size(), p);
-        if (table[to_rm_state][to_rm_state] != "")
-            S = star(table[to_rm_state][to_rm_state]);
+        const RegexId loop = table.get(to_rm_state, to_rm_state);
+        if (loop != RegexDAG::EMPTY)
+            S = regexes.star(loop);
         else
-            S = EPS;
+            S = RegexDAG::EPSILON;
 
-        table[to_rm_state][to_rm_state] = "";
+        set_cell(to_rm_state, to_rm_state, RegexDAG::EMPTY);
 
         //fill q, p, R
         int i = 0;
         for (const auto &in_state: in_states) {
-            q[i] = table[in_state][to_rm_state];
-            table[in_state][to_rm_state] = "";
+            q[i] = table.get(in_state, to_rm_state);
+            set_cell(in_state, to_rm_state, RegexDAG::EMPTY);
             i++;
         }
         i = 0;
         for (const auto &out_state: out_states) {
-            p[i] = table[to_rm_state][out_state];
-            table[to_rm_state][out_state] = "";
+            p[i] = table.get(to_rm_state, out_state);
+            set_cell(to_rm_state, out_state, RegexDAG::EMPTY);
             i++;
         }
         i = 0;
         for (const auto &in_state: in_states) {
             int j = 0;
             for (const auto &out_state: out_states) {
-                R[i][j] = table[in_state][out_state];
+                R[i][j] = table.get(in_state, out_state);
                 j++;
             }
             i++;
@@ -231,105 +613,136 @@ public:
         for (const auto &in_state: in_states) {
             int j = 0;
             for (const auto &out_state: out_states) {
-                if (R[i][j] != "")
-                    table[in_state][out_state] = "(" + R[i][j] + "|" + concat({q[i], S, p[j]}) + ")";
+                if (R[i][j] != RegexDAG::EMPTY)
+                    set_cell(in_state, out_state, regexes.either({R[i][j], regexes.concat({q[i], S, p[j]})}));
                 else
-                    table[in_state][out_state] = concat({q[i], S, p[j]});
+                    set_cell(in_state, out_state, regexes.concat({q[i], S, p[j]}));
                 j++;
             }
             i++;
         }
         active_states.erase(to_rm_state);
+        FLA_COUNT("dfa2re.states_eliminated", 1);
+        FLA_PEAK("dfa2re.peak_fan", in_states.size() * out_states.size());
+        FLA_PEAK("dfa2re.peak_regex_nodes", regexes.size());
     }
 
-    void delete_intermediate_states() {
-        std::string state_to_rm;
-        while ((state_to_rm = min_in_out()) != "") {
+    // Eliminates every state but the initial and final ones, cheapest first by `init_heuristic`.
+    void delete_intermediate_states(EliminationHeuristic init_heuristic = min_degree) {
+        FLA_PHASE("dfa2re.eliminate");
+        heuristic = init_heuristic;
+        queue.reset(names.size());
+        for (const uint32_t state: active_states) {
+            if (state != init_state and state != final_state) {
+                queue.push(state, priority(state));
+            }
+        }
+        while (!queue.empty()) {
+            const uint32_t state_to_rm = queue.pop();
+            eliminated.push_back(state_to_rm);
             delete_state(state_to_rm);
         }
     }
 
-    friend std::string delete_finals(const MDFA &dfa);
-
-private:
-    TransitionTable table;
-    std::string init_state;
-    std::set<std::string> final_states;
-    std::set<std::string> active_states;
-};
-
-std::string delete_finals(const MDFA &dfa) {
-    std::set<std::string> X;
-
-    for (const auto &final_state: dfa.final_states) {
-        MDFA one_final_dfa(dfa, final_state);
-        one_final_dfa.delete_intermediate_states();
+    std::vector<std::string> elimination_order() const {
+        std::vector<std::string> order;
+        for (const uint32_t state: eliminated) {
+            order.push_back(names[state]);
+        }
+        return order;
+    }
 
-        auto init_state = one_final_dfa.init_state;
+    friend std::string delete_finals(MDFA &dfa);
 
-        if (one_final_dfa.init_state == final_state) {
-            std::string R = one_final_dfa.table[init_state][final_state];
-            if (R == "") {
-                X.insert(EPS);
-            } else {
-                X.insert(star(R));
-            }
+private:
+    // the edges of a state apart from its self-loop, and the printed length of their labels
+    struct Incidence {
+        int in = 0;
+        int out = 0;
+        int loop = 0;
+        double in_length = 0;
+        double out_length = 0;
+        double loop_length = 0;
+    };
+
+    void account(uint32_t from, uint32_t to, RegexId regex, int sign) {
+        if (regex == RegexDAG::EMPTY) {
+            return;
+        }
+        const double length = sign * regexes.length(regex);
+        if (from == to) {
+            incidence[from].loop += sign;
+            incidence[from].loop_length += length;
         } else {
-            std::string R, S, U, T;
-            R = one_final_dfa.table[init_state][init_state];
-            S = one_final_dfa.table[init_state][final_state];
-            U = one_final_dfa.table[final_state][final_state];
-            if (U != "") {
-                U = star(U);
-            } else {
-                U = EPS;
-            }
-            T = one_final_dfa.table[final_state][init_state];
-
-            std::string res;
-            if (R == "" and concat({S, U, T}) == "")
-                res = concat({S, U});
-            else if (R == "")
-                res = star(concat({S, U, T})) + concat({S, U});
-            else if (concat({S, U, T}) == "")
-                
-                res = star(R) + concat({S, U});
-
-            X.insert(res);
+            incidence[from].out += sign;
+            incidence[from].out_length += length;
+            incidence[to].in += sign;
+            incidence[to].in_length += length;
         }
-
     }
 
-    
-    std::string res;
+    // every write to the table goes through here, so the incidences and the queue stay current
+    void set_cell(uint32_t from, uint32_t to, RegexId regex) {
+        account(from, to, table.get(from, to), -1);
+        table.set(from, to, regex);
+        account(from, to, regex, 1);
+        if (queue.contains(from)) {
+            queue.update(from, priority(from));
+        }
+        if (to != from and queue.contains(to)) {
+            queue.update(to, priority(to));
+        }
+    }
 
-    bool has_eps = std::find(X.begin(), X.end(), EPS) != X.end();
-//    has_eps = false;
-    for (const auto &reg : X) {
-        if (reg != EPS)
-            res += "|" + reg;
+    double priority(uint32_t state) const {
+        const Incidence &edges = incidence[state];
+        if (heuristic == min_degree) {
+            return edges.in + edges.out + 2 * edges.loop;
+        }
+        return edges.in_length * (edges.out - 1) + edges.out_length * (edges.in - 1) +
+               edges.loop_length * (double(edges.in) * edges.out - 1);
     }
 
-    if (!has_eps) {
-        res.erase(0, 1);
+    std::vector<std::string> names;
+    RegexDAG regexes;
+    TransitionTable table;
+    uint32_t init_state;
+    uint32_t final_state;
+    std::set<uint32_t> active_states;
+    std::vector<Incidence> incidence;
+    EliminationHeuristic heuristic = min_degree;
+    EliminationQueue queue;
+    std::vector<uint32_t> eliminated;
+};
+
+// Every accepting path runs from INIT to FINAL, which have no incoming and no outgoing edges
+// respectively, so once the other states are eliminated the edge INIT -> FINAL is the whole
+// language. eps prints as nothing. Expects delete_intermediate_states to have run already, with
+// whatever heuristic the caller chose.
+std::string delete_finals(MDFA &dfa) {
+    FLA_PHASE("dfa2re.finals");
+    if (dfa.active_states.size() != 2) {
+        throw std::logic_error("delete_finals: " + std::to_string(dfa.active_states.size() - 2) +
+                               " intermediate states left");
     }
-    
+    std::string res = dfa.regexes.to_string(dfa.table.get(dfa.init_state, dfa.final_state));
     res.erase(std::remove(res.begin(), res.end(), '@'), res.end());
-    
-//    if (res.find("()*") != std::string::npos)
-//        return "";
     return res;
-    
 }
 
 
-std::string dfa2re(DFA &d) {
-    
-    MDFA my_dfa(d);
-    my_dfa.to_graphviz("../out.gv");
-    my_dfa.delete_intermediate_states();
-    my_dfa.to_graphviz("../out1.gv");
+// `order` receives the names of the intermediate states in the order they were eliminated.
+std::string dfa2re(DFA &d, EliminationHeuristic heuristic, std::vector<std::string> &order) {
+    FLA_PHASE("dfa2re");
+    MDFA my_dfa(FlatDFA::from_api(d));
+    my_dfa.delete_intermediate_states(heuristic);
+    order = my_dfa.elimination_order();
     const auto res = delete_finals(my_dfa);
-    std::cout << "Ans: " << res << std::endl;
+    FLA_COUNT("dfa2re.regex_length", res.size());
     return res;
 }
+
+std::string dfa2re(DFA &d) {
+    std::vector<std::string> order;
+    return dfa2re(d, min_degree, order);
+}
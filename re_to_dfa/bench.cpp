@@ -0,0 +1,272 @@
+// Benchmark for re2dfa compile time and CompiledDFA throughput. Build it next to task.cpp, against
+// the same api.hpp:
+//
+//   g++ -std=c++17 -O2 -pthread bench.cpp -o bench
+//   ./bench [--suites compile,match] [--positions 1000,5000,...] [--shapes pairs,words]
+//           [--megabytes 64] [--repeat 3] [--seed 1] [--timeout 60]
+//
+// Prints a JSON array of records.
+// - The compile suite builds large regexes and times re2dfa on them:
+//   - "pairs" is (xy|xy|...)*, whose followpos sets are large;
+//   - "words" is a starred union of random words over eight letters.
+// - The match suite runs over synthetic log lines. The target is 1 GB/s per core on each case:
+//   - filter_lines is the log-filtering workload: matching_lines() over the whole log;
+//   - matches_tokens runs matches() over a buffer of log tokens that never reaches the dead row,
+//     so every byte costs a step.
+//   Throughput is input bytes over the best of --repeat runs.
+// Each case runs in a forked child: its peak RSS is its own, and a case still running after
+// --timeout seconds is killed and reported with "timed_out": true.
+#include "task.cpp"
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <random>
+#include <csignal>
+#include <sstream>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+struct BenchConfig {
+    std::vector<std::string> suites = {"compile", "match"};
+    std::vector<size_t> positions = {1000, 5000, 20000};
+    std::vector<std::string> shapes = {"pairs", "words"};
+    size_t megabytes = 64;
+    size_t repeat = 3;
+    uint64_t seed = 1;
+    unsigned timeout = 60;
+};
+
+// About `positions` symbol positions, in the given shape.
+std::string large_regex(const std::string &shape, size_t positions, std::mt19937_64 &rng) {
+    std::string regex = "(";
+    size_t used = 0;
+    while (used < positions) {
+        regex += used ? "|" : "";
+        if (shape == "pairs") {
+            regex += "xy";
+            used += 2;
+        } else {
+            const size_t length = 5 + rng() % 10;
+            for (size_t i = 0; i < length; i++) {
+                regex += "abcdefgh"[rng() % 8];
+            }
+            used += length;
+        }
+    }
+    return regex + ")*";
+}
+
+const std::vector<std::string> levels = {"INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR"};
+const std::vector<std::string> events = {"request served", "cache miss", "connection reset by peer",
+                                         "retrying upstream", "timeout waiting for lock", "user logged in"};
+
+// Lines like "2026-10-18T12:34:56Z INFO worker-17 request served in 123ms id=3fa9c0", one in six
+// at ERROR and one in six at WARN.
+std::vector<std::string> log_lines(size_t bytes, std::mt19937_64 &rng) {
+    std::vector<std::string> lines;
+    size_t total = 0;
+    while (total < bytes) {
+        char line[160];
+        const int length = std::snprintf(line, sizeof(line), "2026-10-18T%02u:%02u:%02uZ %s worker-%u %s in %ums id=%06llx\n",
+                                         unsigned(rng() % 24), unsigned(rng() % 60), unsigned(rng() % 60),
+                                         levels[rng() % levels.size()].c_str(), unsigned(rng() % 64),
+                                         events[rng() % events.size()].c_str(), unsigned(rng() % 5000),
+                                         (unsigned long long) (rng() % 0xffffff));
+        lines.emplace_back(line, size_t(length));
+        total += size_t(length);
+    }
+    return lines;
+}
+
+// The alphanumeric characters of the log, as one buffer.
+std::string log_tokens(const std::vector<std::string> &lines) {
+    std::string tokens;
+    for (const auto &line: lines) {
+        for (char c: line) {
+            if (std::isalnum((unsigned char) c)) {
+                tokens += c;
+            }
+        }
+    }
+    return tokens;
+}
+
+std::string any_alnum() {
+    std::string regex = "(";
+    for (int c = 0; c < 256; c++) {
+        if (std::isalnum(c)) {
+            regex += regex.size() > 1 ? "|" : "";
+            regex += char(c);
+        }
+    }
+    return regex + ")*";
+}
+
+template<class F>
+double best_ms(size_t repeat, const F &run) {
+    double best = 0;
+    for (size_t i = 0; i < std::max<size_t>(repeat, 1); i++) {
+        const auto start = std::chrono::steady_clock::now();
+        run();
+        const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        best = i == 0 ? ms : std::min(best, ms);
+    }
+    return best;
+}
+
+std::string peak_rss_json() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return ", \"peak_rss_kb\": " + std::to_string(usage.ru_maxrss);
+}
+
+std::string run_compile(const BenchConfig &config, const std::string &shape, size_t positions) {
+    std::mt19937_64 rng(config.seed);
+    const std::string regex = large_regex(shape, positions, rng);
+    CompileStats stats;
+    size_t states = 0;
+    const double ms = best_ms(config.repeat, [&] { states = re2dfa(regex, stats).get_states().size(); });
+    std::ostringstream out;
+    out << "  {\"suite\": \"compile\", \"shape\": \"" << shape << "\", \"positions\": " << positions
+        << ", \"regex_length\": " << regex.size() << ", \"dfa_states\": " << states << ", \"ms\": " << ms
+        << peak_rss_json() << "}";
+    return out.str();
+}
+
+// `workload` is filter_lines (matching_lines() over the log) or matches_tokens (one matches()
+// over all alphanumeric log bytes).
+std::string run_match(const BenchConfig &config, const std::string &pattern, const std::string &workload) {
+    std::mt19937_64 rng(config.seed);
+    const std::vector<std::string> lines = log_lines(config.megabytes << 20, rng);
+    const CompiledDFA compiled = CompiledDFA::compile(re2dfa(pattern));
+    size_t bytes = 0;
+    size_t hits = 0;
+    double ms = 0;
+    if (workload == "filter_lines") {
+        std::string log;
+        for (const auto &line: lines) {
+            log += line;
+        }
+        bytes = log.size();
+        compiled.find("");  // builds the unanchored table outside the timing
+        ms = best_ms(config.repeat, [&] { hits = compiled.matching_lines(log).size(); });
+    } else {
+        const std::string tokens = log_tokens(lines);
+        bytes = tokens.size();
+        ms = best_ms(config.repeat, [&] { hits = compiled.matches(tokens); });
+    }
+    std::ostringstream out;
+    out << "  {\"suite\": \"match\", \"workload\": \"" << workload << "\", \"pattern_length\": " << pattern.size()
+        << ", \"dfa_states\": " << compiled.state_count() << ", \"bytes\": " << bytes << ", \"hits\": " << hits
+        << ", \"ms\": " << ms << ", \"gb_per_s\": " << double(bytes) / ms / 1e6 << peak_rss_json() << "}";
+    return out.str();
+}
+
+// Runs `run_case` in a child process and returns its record, or "" if the child failed.
+template<class F>
+std::string run_isolated(const BenchConfig &config, const std::string &label, const F &run_case) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return "";
+    }
+    const pid_t child = fork();
+    if (child == 0) {
+        close(fds[0]);
+        alarm(config.timeout);
+        const std::string record = run_case();
+        const bool written = write(fds[1], record.data(), record.size()) == ssize_t(record.size());
+        std::_Exit(written ? 0 : 1);
+    }
+    close(fds[1]);
+    std::string record;
+    char buffer[4096];
+    ssize_t got;
+    while ((got = read(fds[0], buffer, sizeof(buffer))) > 0) {
+        record.append(buffer, size_t(got));
+    }
+    close(fds[0]);
+    int status = 0;
+    waitpid(child, &status, 0);
+    if (child > 0 and WIFSIGNALED(status) and WTERMSIG(status) == SIGALRM) {
+        std::ostringstream out;
+        out << "  {\"case\": \"" << label << "\", \"timed_out\": true, \"timeout_s\": " << config.timeout << "}";
+        return out.str();
+    }
+    return child > 0 and WIFEXITED(status) and WEXITSTATUS(status) == 0 ? record : "";
+}
+
+template<class T, class F>
+std::vector<T> split_list(const std::string &list, const F &convert) {
+    std::vector<T> items;
+    std::stringstream in(list);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        if (!item.empty()) {
+            items.push_back(convert(item));
+        }
+    }
+    return items;
+}
+
+int main(int argc, char **argv) {
+    BenchConfig config;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        const std::string flag = argv[i];
+        const std::string value = argv[i + 1];
+        if (flag == "--suites") {
+            config.suites = split_list<std::string>(value, [](const std::string &s) { return s; });
+        } else if (flag == "--positions") {
+            config.positions = split_list<size_t>(value, [](const std::string &s) { return size_t(std::stoull(s)); });
+        } else if (flag == "--shapes") {
+            config.shapes = split_list<std::string>(value, [](const std::string &s) { return s; });
+        } else if (flag == "--megabytes") {
+            config.megabytes = std::stoul(value);
+        } else if (flag == "--repeat") {
+            config.repeat = std::stoul(value);
+        } else if (flag == "--seed") {
+            config.seed = std::stoull(value);
+        } else if (flag == "--timeout") {
+            config.timeout = unsigned(std::stoul(value));
+        } else {
+            std::fprintf(stderr, "unknown option %s\n", flag.c_str());
+            return 2;
+        }
+    }
+
+    std::vector<std::pair<std::string, std::function<std::string()>>> cases;
+    for (const auto &suite: config.suites) {
+        if (suite == "compile") {
+            for (const auto &shape: config.shapes) {
+                for (size_t positions: config.positions) {
+                    cases.emplace_back("compile/" + shape + "/" + std::to_string(positions),
+                                       [&config, shape, positions] { return run_compile(config, shape, positions); });
+                }
+            }
+        } else if (suite == "match") {
+            const std::string keywords = "(ERROR|WARN|timeout|reset)";
+            const std::string tokens = any_alnum();
+            cases.emplace_back("match/filter_lines", [&config, keywords] { return run_match(config, keywords, "filter_lines"); });
+            cases.emplace_back("match/matches_tokens", [&config, tokens] { return run_match(config, tokens, "matches_tokens"); });
+        } else {
+            std::fprintf(stderr, "unknown suite %s\n", suite.c_str());
+            return 2;
+        }
+    }
+
+    std::printf("[\n");
+    bool first = true;
+    for (const auto &item: cases) {
+        const std::string record = run_isolated(config, item.first, item.second);
+        if (record.empty()) {
+            std::fprintf(stderr, "%s failed\n", item.first.c_str());
+            continue;
+        }
+        std::printf("%s%s", first ? "" : ",\n", record.c_str());
+        std::fflush(stdout);
+        first = false;
+    }
+    std::printf("\n]\n");
+    return 0;
+}
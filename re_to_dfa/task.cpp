@@ -1,36 +1,187 @@
 #include "api.hpp"
+#include "../common/fla.hpp"
 #include <string>
 #include <utility>
 #include <vector>
+#include <cstdint>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <string_view>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <cstdio>
+#include <fstream>
+#include <list>
+#include <stdexcept>
 #include "iostream"
 #include "map"
 
 const char EPS = '@';
 
-template<typename T>
-std::set<T> getUnion(const std::set<T> &a, const std::set<T> &b) {
-    std::set<T> result = a;
-    result.insert(b.begin(), b.end());
-    return result;
-}
+// Dense bitset over the positions of one regex, sized once for the whole compilation.
+class PosSet {
+public:
+    PosSet() = default;
+
+    explicit PosSet(size_t universe) : words((universe + 63) / 64, 0) {}
+
+    void insert(size_t pos) {
+        words[pos >> 6] |= uint64_t(1) << (pos & 63);
+    }
+
+    bool contains(size_t pos) const {
+        return (words[pos >> 6] >> (pos & 63)) & 1;
+    }
+
+    bool empty() const {
+        for (uint64_t word: words) {
+            if (word != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void unite(const PosSet &other) {
+        unite(other.words.data());
+    }
+
+    void clear() {
+        std::fill(words.begin(), words.end(), 0);
+    }
+
+    void unite(const uint64_t *row) {
+        for (size_t i = 0; i < words.size(); i++) {
+            words[i] |= row[i];
+        }
+    }
+
+    template<class F>
+    void for_each(F f) const {
+        for (size_t i = 0; i < words.size(); i++) {
+            uint64_t word = words[i];
+            while (word != 0) {
+                f(i * 64 + __builtin_ctzll(word));
+                word &= word - 1;
+            }
+        }
+    }
+
+    // Visits positions present in both sets: one AND per word, no temporary set.
+    template<class F>
+    void for_each_common(const PosSet &other, F f) const {
+        for (size_t i = 0; i < words.size(); i++) {
+            uint64_t word = words[i] & other.words[i];
+            while (word != 0) {
+                f(i * 64 + __builtin_ctzll(word));
+                word &= word - 1;
+            }
+        }
+    }
+
+    const uint64_t *data() const {
+        return words.data();
+    }
+
+    bool operator==(const PosSet &other) const {
+        return words == other.words;
+    }
+
+    size_t hash() const {
+        uint64_t h = 1469598103934665603ULL;
+        for (uint64_t word: words) {
+            h ^= word + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+        }
+        return h;
+    }
+
+private:
+    std::vector<uint64_t> words;
+};
+
+struct PosSetHash {
+    size_t operator()(const PosSet &set) const {
+        return set.hash();
+    }
+};
+
+// Rows of position bitsets in one flat buffer. Used for followpos (row = position)
+// and for the per-node firstpos/lastpos of the syntax tree (row = node id).
+class BitMatrix {
+public:
+    BitMatrix() : n_universe(0), row_words(0) {}
+
+    explicit BitMatrix(size_t rows, size_t init_universe) : n_universe(init_universe),
+                                                            row_words((init_universe + 63) / 64),
+                                                            bits(rows * row_words, 0) {}
+
+    void set(size_t row, size_t pos) {
+        bits[row * row_words + (pos >> 6)] |= uint64_t(1) << (pos & 63);
+    }
+
+    void add(size_t row, const PosSet &set) {
+        add(row, set.data());
+    }
+
+    void add_row(size_t row, const BitMatrix &src, size_t src_row) {
+        add(row, &src.bits[src_row * row_words]);
+    }
+
+    void unite_into(size_t row, PosSet &dst) const {
+        dst.unite(&bits[row * row_words]);
+    }
+
+    template<class F>
+    void for_each(size_t row, F f) const {
+        const uint64_t *words = &bits[row * row_words];
+        for (size_t i = 0; i < row_words; i++) {
+            uint64_t word = words[i];
+            while (word != 0) {
+                f(i * 64 + __builtin_ctzll(word));
+                word &= word - 1;
+            }
+        }
+    }
+
+    size_t universe() const {
+        return n_universe;
+    }
+
+private:
+    void add(size_t row, const uint64_t *src) {
+        uint64_t *dst = &bits[row * row_words];
+        for (size_t i = 0; i < row_words; i++) {
+            dst[i] |= src[i];
+        }
+    }
+
+    size_t n_universe;
+    size_t row_words;
+    std::vector<uint64_t> bits;
+};
 
 enum TypeOfOperation {
     concat, repeat, choice, none_type
 };
 
+// State names are numbered per compilation, so re2dfa keeps no global state.
 class NameGetter {
 public:
-    static std::string get_name() {
+    std::string get_name() {
         num++;
         return "q" + std::to_string(num - 1);
     }
 
 private:
-    static int num;
+    int num = 0;
 };
 
-int NameGetter::num = 0;
-
 class Converter {
 public:
 
@@ -56,6 +207,19 @@ public:
         // #
 
         f.emplace_back(j, '#');
+
+        pos_to_sym.assign(j + 1, '?');
+        for (const auto &field: f) {
+            if (field.position != 0) {
+                pos_to_sym[field.position] = field.sym;
+            }
+        }
+        for (const auto &field: f) {
+            if (field.position != 0 and field.sym != '#') {
+                auto it = sym_to_pos.emplace(field.sym, PosSet(j + 1)).first;
+                it->second.insert(field.position);
+            }
+        }
     }
 
     size_t convert_to_pos(size_t raw_position) {
@@ -63,12 +227,16 @@ public:
     }
 
     char convert_to_sym(const size_t position) const {
-        for (auto i = 0; i < f.max_size(); i++) {
-            if (f[i].position == position) {
-                return f[i].sym;
-            }
+        return pos_to_sym[position];
+    }
+
+    // All positions labelled with `sym`; empty set if the regex never uses it.
+    PosSet positions_of(char sym) const {
+        auto it = sym_to_pos.find(sym);
+        if (it == sym_to_pos.end()) {
+            return PosSet(pos_to_sym.size());
         }
-        return -1;
+        return it->second;
     }
 
     size_t get_max_pos() {
@@ -80,372 +248,1287 @@ public:
 
 private:
     std::vector<FieldOfPositions> f;
+    std::vector<char> pos_to_sym;
+    std::map<char, PosSet> sym_to_pos;
 };
 
+typedef uint32_t NodeId;
+const NodeId NO_NODE = UINT32_MAX;
+
 struct Node {
 
-    explicit Node(const char init_sym, size_t position) : sym(init_sym),
-                                                          is_leaf(true),
-                                                          left(nullptr),
-                                                          mid(nullptr),
-                                                          right(nullptr),
-                                                          type(none_type),
-                                                          first_pos({position}),
-                                                          last_pos({position}) {
+    explicit Node(const char init_sym, size_t init_position) : left(NO_NODE),
+                                                               right(NO_NODE),
+                                                               mid(NO_NODE),
+                                                               is_leaf(true),
+                                                               type(none_type),
+                                                               sym(init_sym),
+                                                               position(init_position) {
         nullable = (init_sym == EPS);
     }
 
-    explicit Node(TypeOfOperation init_type, Node *left, Node *right) : sym('?'),
-                                                                        is_leaf(false),
-                                                                        left(left),
-                                                                        mid(nullptr),
-                                                                        right(right),
-                                                                        type(init_type),
-                                                                        nullable(false) {}
-
-    explicit Node(TypeOfOperation init_type, Node *mid) : sym('?'), is_leaf(false),
-                                                          left(nullptr),
-                                                          mid(mid),
-                                                          right(nullptr),
-                                                          type(init_type),
-                                                          nullable(false) {}
-
-
-    Node *left;
-    Node *right;
-    Node *mid;
+    explicit Node(TypeOfOperation init_type, NodeId left, NodeId right) : left(left),
+                                                                          right(right),
+                                                                          mid(NO_NODE),
+                                                                          is_leaf(false),
+                                                                          type(init_type),
+                                                                          sym('?'),
+                                                                          position(0),
+                                                                          nullable(false) {}
+
+    explicit Node(TypeOfOperation init_type, NodeId mid) : left(NO_NODE),
+                                                           right(NO_NODE),
+                                                           mid(mid),
+                                                           is_leaf(false),
+                                                           type(init_type),
+                                                           sym('?'),
+                                                           position(0),
+                                                           nullable(false) {}
+
+
+    NodeId left;
+    NodeId right;
+    NodeId mid;
 
     const bool is_leaf;
     const TypeOfOperation type;
     const char sym;
+    const size_t position;
 
     bool nullable;
-    std::set<size_t> first_pos;
-    std::set<size_t> last_pos;
 };
 
+// Per-compilation storage for the syntax tree. Nodes refer to each other by index and are
+// always created after their children, so index order is a valid post-order. firstpos and
+// lastpos live in two bit matrices indexed by node id; release() frees everything at once.
+class NodeArena {
+public:
+    void reserve(size_t n) {
+        nodes.reserve(n);
+    }
+
+    NodeId make_leaf(const char sym, size_t position) {
+        nodes.emplace_back(sym, position);
+        return NodeId(nodes.size() - 1);
+    }
+
+    NodeId make(TypeOfOperation type, NodeId left, NodeId right) {
+        nodes.emplace_back(type, left, right);
+        return NodeId(nodes.size() - 1);
+    }
+
+    NodeId make(TypeOfOperation type, NodeId mid) {
+        nodes.emplace_back(type, mid);
+        return NodeId(nodes.size() - 1);
+    }
 
+    Node &operator[](NodeId id) {
+        return nodes[id];
+    }
+
+    const Node &operator[](NodeId id) const {
+        return nodes[id];
+    }
+
+    size_t size() const {
+        return nodes.size();
+    }
+
+    void release() {
+        std::vector<Node>().swap(nodes);
+        first_pos = BitMatrix();
+        last_pos = BitMatrix();
+    }
+
+    BitMatrix first_pos;
+    BitMatrix last_pos;
+
+private:
+    std::vector<Node> nodes;
+};
+
+
+// Left-to-right parser with an explicit stack of open groups, so native stack depth does not
+// depend on the input. Grammar: E := T ('|' T)*, T := F*, F := atom '*'*, atom := symbol |
+// '@' | '(' E ')'. Concatenation and choice associate to the left and an empty T is an
+// epsilon leaf; an empty T takes the position of the character after it, which is the end
+// marker when the regex ends there. Every node is created after its children.
 struct Parser {
 
     const std::string s;
-    size_t current_position;
-    char current_sym;
     const Alphabet alphabet;
     Converter converter;
+    NodeArena arena;
 
+    // `init_s` is the regex prefixed with '#'
     explicit Parser(const std::string &init_s, const Alphabet &init_alphabet) :
             s(init_s),
             alphabet(init_alphabet),
             converter(s, alphabet) {
-        current_position = s.length();
-        // std::cout << "Init s: " << s << std::endl;
-    }
-
-    char next_sym() {
-        if (current_position == 0) {
-            std::cout << "Segfauld" << std::endl;
-            return '?';
-        }
-        current_position--;
-        current_sym = s[current_position];
-//        std::cout << std::string("Cur sym ") + s[current_position] << std::endl;
-        return s[current_position];
-    }
-
-    void back_sym() {
-        current_position++;
-        current_sym = s[current_position];
-//        std::cout << std::string("Cur sym (back_sym)") + s[current_position] << std::endl;
-    }
-
-    Node *E() {
-        // std::cout << "E is called" << std::endl;
-        // sleep(1);
-
-        Node *right = T();
-        Node *left = nullptr;
-        char sym = next_sym();
-        if (sym == '|') {
-            left = E();
-            return new Node(choice, left, right);
-        } else if (sym == '#') {
-            std::cout << "Successful reading!" << std::endl;
-//            left = new Node('#', converter.get_max_pos());
-//            return new Node(concat, right, left);
-            return right;
-        } else {
-            back_sym();
-            return right;
+        arena.reserve(2 * s.length() + 2);
+    }
+
+    NodeId parse() {
+        struct Group {
+            NodeId alternatives;
+            NodeId term;
+            size_t open;
+        };
+        std::vector<Group> groups = {{NO_NODE, NO_NODE, 0}};
+
+        for (size_t i = 1; i < s.length(); i++) {
+            const char sym = s[i];
+            NodeId atom = NO_NODE;
+            if (alphabet.has_char(sym)) {
+                atom = arena.make_leaf(sym, converter.convert_to_pos(i));
+            } else if (sym == EPS) {
+                atom = arena.make_leaf(EPS, converter.convert_to_pos(i));
+            } else if (sym == '(') {
+                groups.push_back({NO_NODE, NO_NODE, i});
+                continue;
+            } else if (sym == ')') {
+                if (groups.size() == 1) {
+                    error(i, "unmatched ')'");
+                }
+                atom = finish(groups.back().alternatives, groups.back().term, i);
+                groups.pop_back();
+            } else if (sym == '|') {
+                Group &group = groups.back();
+                group.alternatives = finish(group.alternatives, group.term, i);
+                group.term = NO_NODE;
+                continue;
+            } else if (sym == '*') {
+                error(i, "'*' without an operand");
+            } else {
+                error(i, std::string("unexpected character '") + sym + "'");
+            }
+
+            while (i + 1 < s.length() and s[i + 1] == '*') {
+                atom = arena.make(repeat, atom);
+                i++;
+            }
+            Group &group = groups.back();
+            group.term = group.term == NO_NODE ? atom : arena.make(concat, group.term, atom);
         }
+
+        if (groups.size() != 1) {
+            error(groups.back().open, "unmatched '('");
+        }
+        return finish(groups.back().alternatives, groups.back().term, s.length());
     }
 
-    Node *T() {
-        // std::cout << "T is called" << std::endl;
-        // sleep(1);
-        Node *left;
-        Node *right;
+private:
+    // Closes the current alternative, which ends just before raw index `end`.
+    NodeId finish(NodeId alternatives, NodeId term, size_t end) {
+        if (term == NO_NODE) {
+            term = arena.make_leaf(EPS, converter.convert_to_pos(end));
+        }
+        if (alternatives == NO_NODE) {
+            return term;
+        }
+        return arena.make(choice, alternatives, term);
+    }
 
-        right = F();
-        char sym = next_sym();
-        back_sym();
+    // `raw` indexes `s`, which carries the '#' prefix
+    [[noreturn]] void error(size_t raw, const std::string &message) const {
+        throw std::invalid_argument("regex syntax error at position " + std::to_string(raw - 1) + ": " + message);
+    }
+};
 
-        if (sym != '|' and sym != '#' and sym != '(') {
-            left = T();
-            return new Node(concat, left, right);
+// One pass computing nullable, firstpos, lastpos and followpos. Children always precede
+// their parent in the arena, so a forward sweep over node ids visits the tree in post-order.
+void fill_attributes(NodeArena &arena, BitMatrix &table_follow_pos) {
+    const size_t universe = table_follow_pos.universe();
+    arena.first_pos = BitMatrix(arena.size(), universe);
+    arena.last_pos = BitMatrix(arena.size(), universe);
+    BitMatrix &first_pos = arena.first_pos;
+    BitMatrix &last_pos = arena.last_pos;
+
+    for (NodeId id = 0; id < arena.size(); id++) {
+        Node &tree = arena[id];
+        const NodeId left = tree.left;
+        const NodeId right = tree.right;
+        const NodeId mid = tree.mid;
+        switch (tree.type) {
+            case concat:
+                last_pos.for_each(left, [&](size_t pos) {
+                    table_follow_pos.add_row(pos, first_pos, right);
+                });
+                tree.nullable = arena[left].nullable and arena[right].nullable;
+                first_pos.add_row(id, first_pos, left);
+                if (arena[left].nullable) first_pos.add_row(id, first_pos, right);
+                last_pos.add_row(id, last_pos, right);
+                if (arena[right].nullable) last_pos.add_row(id, last_pos, left);
+                break;
+            case repeat:
+                last_pos.for_each(mid, [&](size_t pos) {
+                    table_follow_pos.add_row(pos, first_pos, mid);
+                });
+                tree.nullable = true;
+                first_pos.add_row(id, first_pos, mid);
+                last_pos.add_row(id, last_pos, mid);
+                break;
+            case choice:
+                tree.nullable = arena[left].nullable or arena[right].nullable;
+                first_pos.add_row(id, first_pos, left);
+                first_pos.add_row(id, first_pos, right);
+                last_pos.add_row(id, last_pos, left);
+                last_pos.add_row(id, last_pos, right);
+                break;
+            case none_type:
+                first_pos.set(id, tree.position);
+                last_pos.set(id, tree.position);
+                break;
         }
-        return right;
     }
+}
+
+// Interns position sets as DFA states: every set gets a dense integer id on creation.
+class DFAHelper {
+public:
+    static const size_t npos = -1;
 
-    Node *F() {
-        // std::cout << "F is called" << std::endl;
-        // sleep(1);
-        Node *mid;
+    std::unordered_map<PosSet, size_t, PosSetHash> pos_to_id = {};
+    std::vector<const PosSet *> sets = {};
 
-        char sym = next_sym();
-        if (sym == '*') {
-            sym = next_sym();
-            if (sym == ')') {
-                mid = E();
-                next_sym(); // (
-                return new Node(repeat, mid);
-            } else {
-                back_sym();
-                mid = C();
-                return new Node(repeat, mid);
-            }
+    size_t create_state(const PosSet &set) {
+        auto it = pos_to_id.emplace(set, sets.size()).first;
+        sets.push_back(&it->first);
+        return sets.size() - 1;
+    }
 
-        } else if (sym == ')') {
-            mid = E();
-            next_sym(); // (
-            return mid;
-        } else {
-            back_sym();
-            mid = C();
-            return mid;
+    size_t get_id(const PosSet &by) const {
+        auto it = pos_to_id.find(by);
+        if (it == pos_to_id.end()) {
+            return npos;
         }
+        return it->second;
     }
 
-    Node *C() {
-        // std::cout << "C is called" << std::endl;
-        // sleep(1);
+    const PosSet &get_set(size_t id) const {
+        return *sets[id];
+    }
 
-        char sym = next_sym();
-        if (!alphabet.has_char(sym)) {
-            // std::cout << "Read eps" << std::endl;
-            back_sym();
-            return new Node(EPS, converter.convert_to_pos(current_position));
-        } else {
-            // std::cout << "Read " << sym << std::endl;
-            return new Node(sym, converter.convert_to_pos(current_position));
+    size_t size() const {
+        return sets.size();
+    }
+
+};
+
+const size_t DFAHelper::npos;
+
+// What subset construction needs from a regex: followpos, the start set and, for every
+// alphabet symbol, the mask of positions labelled with it.
+struct PositionAutomaton {
+    std::string alphabet;
+    BitMatrix table_follow_pos;
+    PosSet start_set;
+    std::vector<PosSet> sym_positions;
+    size_t end_pos;
+
+    explicit PositionAutomaton(const std::string &s) : alphabet(Alphabet(s).to_string()) {
+        FLA_PHASE("re2dfa.positions");
+        Parser parser('#' + s, Alphabet(s));
+        NodeArena &arena = parser.arena;
+        const NodeId right = parser.parse();
+        const NodeId left = arena.make_leaf('#', parser.converter.get_max_pos());
+        const NodeId tree = arena.make(concat, right, left);
+
+        const size_t universe = parser.converter.get_max_pos() + 1;
+        table_follow_pos = BitMatrix(universe, universe);
+        fill_attributes(arena, table_follow_pos);
+
+        start_set = PosSet(universe);
+        arena.first_pos.unite_into(tree, start_set);
+        arena.release();
+
+        for (char sym: alphabet) {
+            sym_positions.push_back(parser.converter.positions_of(sym));
         }
+        end_pos = universe - 1;
+        FLA_COUNT("re2dfa.positions", universe);
+    }
+
+    // S = positions reachable from `set` by reading alphabet[a]
+    void step(const PosSet &set, size_t a, PosSet &S) const {
+        S.clear();
+        set.for_each_common(sym_positions[a], [&](size_t position_in_string) {
+            table_follow_pos.unite_into(position_in_string, S);
+        });
+    }
+
+    PosSet empty_set() const {
+        return PosSet(table_follow_pos.universe());
     }
-    // (a|)*
 };
 
-bool fill_nullable(Node *tree) {
-    bool left;
-    bool right;
-    switch (tree->type) {
-        case concat:
-            left = fill_nullable(tree->left);
-            right = fill_nullable(tree->right);
-            tree->nullable = left and right;
-            return left and right;
-        case repeat:
-            fill_nullable(tree->mid);
-            tree->nullable = true;
-            return true;
-        case choice:
-            left = fill_nullable(tree->left);
-            right = fill_nullable(tree->right);
-            tree->nullable = left or right;
-            return left or right;
-        case none_type:
-            return tree->nullable;
+struct CompileStats {
+    size_t states = 0;
+    size_t peak_worklist = 0;
+};
+
+// Breadth-first subset construction. Ids are handed out in discovery order, so the worklist
+// is just the range of interned but not yet expanded ids and no recursion is needed. States
+// are named q0, q1, ... in id order; q0 is initial.
+FlatDFA create_DFA(const PositionAutomaton &positions, DFAHelper &helper, CompileStats &stats) {
+    FLA_PHASE("re2dfa.subset");
+    FlatDFA automaton(positions.alphabet);
+    const size_t width = automaton.width();
+    NameGetter name_getter;
+
+    auto intern = [&](const PosSet &set) {
+        helper.create_state(set);
+        return automaton.add_state(name_getter.get_name(), set.contains(positions.end_pos));
+    };
+
+    automaton.initial = intern(positions.start_set);
+    PosSet S = positions.empty_set();
+    for (size_t current_id = 0; current_id < helper.size(); current_id++) {
+        stats.peak_worklist = std::max(stats.peak_worklist, helper.size() - current_id);
+        for (size_t a = 0; a < width; a++) {
+            positions.step(helper.get_set(current_id), a, S);
+            if (S.empty()) {
+                continue;
+            }
+            size_t id = helper.get_id(S);
+            if (id == DFAHelper::npos) {
+                id = intern(S);
+            }
+            automaton.set_trans(uint32_t(current_id), a, uint32_t(id));
+        }
     }
+    stats.states = helper.size();
+    FLA_COUNT("re2dfa.states_created", stats.states);
+    FLA_PEAK("re2dfa.peak_worklist", stats.peak_worklist);
+    return automaton;
 }
 
-std::set<size_t> fill_firstpos(Node *tree) {
-    std::set<size_t> left;
-    std::set<size_t> right;
-    std::set<size_t> mid;
-
-    switch (tree->type) {
-        case concat:
-            if (tree->left->nullable) {
-                left = fill_firstpos(tree->left);
-                right = fill_firstpos(tree->right);
-                tree->first_pos = getUnion(left, right);
-                return tree->first_pos;
-            } else {
-                left = fill_firstpos(tree->left);
-                fill_firstpos(tree->right);
-
-                tree->first_pos = left;
-                return tree->first_pos;
-            }
-        case repeat:
-            mid = fill_firstpos(tree->mid);
-            tree->first_pos = mid;
-            return tree->first_pos;
-        case choice:
-            left = fill_firstpos(tree->left);
-            right = fill_firstpos(tree->right);
-            tree->first_pos = getUnion(left, right);
-            return tree->first_pos;
-        case none_type:
-            return tree->first_pos;
-    }
+FlatDFA compile_regex(const std::string &s, CompileStats &stats) {
+    const PositionAutomaton positions(s);
+    DFAHelper helper;
+    return create_DFA(positions, helper, stats);
 }
 
-std::set<size_t> fill_lastpos(Node *tree) {
-    std::set<size_t> left;
-    std::set<size_t> right;
-    std::set<size_t> mid;
-
-    switch (tree->type) {
-        case concat:
-            if (tree->right->nullable) {
-                left = fill_lastpos(tree->left);
-                right = fill_lastpos(tree->right);
-                tree->last_pos = getUnion(left, right);
-                return tree->last_pos;
-            } else {
-                right = fill_lastpos(tree->right);
-                fill_lastpos(tree->left);
-
-                tree->last_pos = right;
-                return tree->last_pos;
-            }
-        case repeat:
-            mid = fill_lastpos(tree->mid);
-            tree->last_pos = mid;
-            return tree->last_pos;
-        case choice:
-            left = fill_lastpos(tree->left);
-            right = fill_lastpos(tree->right);
-            tree->last_pos = getUnion(left, right);
-            return tree->last_pos;
-        case none_type:
-            return tree->last_pos;
-    }
+DFA re2dfa(const std::string &s, CompileStats &stats) {
+    const FlatDFA automaton = compile_regex(s, stats);
+    FLA_PHASE("re2dfa.to_api");
+    return automaton.to_api();
 }
 
-void fill_follow_pos(Node *tree, std::vector<std::set<size_t>> &table_follow_pos) {
-    if (!tree->is_leaf) {
-        if (tree->left != nullptr) fill_follow_pos(tree->left, table_follow_pos);
-        if (tree->right != nullptr) fill_follow_pos(tree->right, table_follow_pos);
-        if (tree->mid != nullptr) fill_follow_pos(tree->mid, table_follow_pos);
+DFA re2dfa(const std::string &s) {
+    CompileStats stats;
+    return re2dfa(s, stats);
+}
+
+// Compiles every regex on `threads` workers (0 = hardware concurrency). Each worker owns a
+// deque of indices seeded with a contiguous block and steals from the back of the other
+// workers' deques once its own is empty. Results are stored by index and state names are
+// per compilation, so the output does not depend on scheduling. The first exception (by
+// index) is rethrown after all workers finish.
+std::vector<DFA> re2dfa_batch(const std::vector<std::string> &regexes, size_t threads = 0) {
+    if (threads == 0) {
+        threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
     }
-    if (tree->type == concat) {
-        for (size_t pos: tree->left->last_pos) {
-            table_follow_pos[pos] = getUnion(table_follow_pos[pos], tree->right->first_pos);
+    threads = std::max<size_t>(std::min(threads, regexes.size()), 1);
+
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<size_t> indices;
+    };
+    std::vector<WorkQueue> queues(threads);
+    for (size_t w = 0; w < threads; w++) {
+        const size_t begin = regexes.size() * w / threads;
+        const size_t end = regexes.size() * (w + 1) / threads;
+        for (size_t i = begin; i < end; i++) {
+            queues[w].indices.push_back(i);
+        }
+    }
+
+    std::vector<std::unique_ptr<DFA>> results(regexes.size());
+    std::vector<std::exception_ptr> errors(regexes.size());
+
+    auto take = [&](size_t worker, size_t &index) {
+        {
+            std::lock_guard<std::mutex> lock(queues[worker].mutex);
+            if (!queues[worker].indices.empty()) {
+                index = queues[worker].indices.front();
+                queues[worker].indices.pop_front();
+                return true;
+            }
+        }
+        for (size_t k = 1; k < threads; k++) {
+            WorkQueue &victim = queues[(worker + k) % threads];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.indices.empty()) {
+                index = victim.indices.back();
+                victim.indices.pop_back();
+                return true;
+            }
+        }
+        return false;
+    };
+
+    auto work = [&](size_t worker) {
+        size_t index;
+        while (take(worker, index)) {
+            try {
+                results[index].reset(new DFA(re2dfa(regexes[index])));
+            } catch (...) {
+                errors[index] = std::current_exception();
+            }
         }
-    } else if (tree->type == repeat) {
-        for (size_t pos: tree->mid->last_pos) {
-            table_follow_pos[pos] = getUnion(table_follow_pos[pos], tree->mid->first_pos);
+    };
+
+    std::vector<std::thread> pool;
+    for (size_t w = 1; w < threads; w++) {
+        pool.emplace_back(work, w);
+    }
+    work(0);
+    for (auto &thread: pool) {
+        thread.join();
+    }
+
+    for (const auto &error: errors) {
+        if (error) {
+            std::rethrow_exception(error);
         }
     }
+    std::vector<DFA> dfas;
+    dfas.reserve(regexes.size());
+    for (auto &result: results) {
+        dfas.push_back(std::move(*result));
+    }
+    return dfas;
 }
 
-class DFAHelper {
+// Canonical form of a regex: its syntax tree in post-order (the order the parser builds it),
+// so regexes that differ only in redundant parentheses share a key. Empty operands are written '@', or '$' when the parser
+// gives them the end position, since that changes the position sets re2dfa builds.
+std::string canonical_regex(const std::string &s) {
+    Parser parser('#' + s, Alphabet(s));
+    parser.parse();
+    const NodeArena &arena = parser.arena;
+    const size_t end_pos = parser.converter.get_max_pos();
+    std::string key;
+    key.reserve(arena.size());
+    for (NodeId id = 0; id < arena.size(); id++) {
+        const Node &node = arena[id];
+        switch (node.type) {
+            case concat:
+                key += '.';
+                break;
+            case repeat:
+                key += '*';
+                break;
+            case choice:
+                key += '|';
+                break;
+            case none_type:
+                if (node.sym != EPS) {
+                    key += node.sym;
+                } else {
+                    key += node.position == end_pos ? '$' : '@';
+                }
+                break;
+        }
+    }
+    return key;
+}
+
+// Two-level cache in front of re2dfa: an in-memory LRU of compiled automata keyed by
+// canonical_regex, backed by an optional directory of binary automaton files.
+//
+// File layout (little endian): "RDFA", u32 format version, u64 payload size, u64 FNV-1a
+// checksum of the payload, then the payload: key, alphabet, state count, final flags and
+// the transition rows (u32, 0xFFFFFFFF for no transition). A file whose magic, version,
+// checksum or key does not match is treated as a miss and rewritten.
+class CompileCache {
 public:
-    std::map<const std::string, std::set<size_t>> name_to_pos = {};
-    std::map<const std::string, bool> marked = {};
+    static const uint32_t format_version = 1;
+
+    struct Stats {
+        size_t memory_hits = 0;
+        size_t disk_hits = 0;
+        size_t misses = 0;
+        // serialized size of the automata served from either layer instead of being rebuilt
+        size_t bytes_saved = 0;
+
+        double hit_rate() const {
+            const size_t lookups = memory_hits + disk_hits + misses;
+            return lookups == 0 ? 0.0 : double(memory_hits + disk_hits) / double(lookups);
+        }
+    };
+
+    explicit CompileCache(size_t init_capacity, const std::string &init_directory = "") :
+            capacity(std::max<size_t>(init_capacity, 1)),
+            directory(init_directory) {}
+
+    DFA re2dfa(const std::string &s) {
+        const std::string key = canonical_regex(s);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = index.find(key);
+            if (it != index.end()) {
+                lru.splice(lru.begin(), lru, it->second);
+                stats_.memory_hits++;
+                stats_.bytes_saved += it->second->bytes;
+                return it->second->automaton.to_api();
+            }
+        }
+
+        FlatDFA automaton;
+        std::string bytes;
+        bool from_disk = false;
+        if (!directory.empty() and read_file(path_of(key), bytes) and deserialize(bytes, key, automaton)) {
+            from_disk = true;
+        } else {
+            CompileStats compile_stats;
+            automaton = compile_regex(s, compile_stats);
+            bytes = serialize(key, automaton);
+            if (!directory.empty()) {
+                write_file(path_of(key), bytes);
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (from_disk) {
+            stats_.disk_hits++;
+            stats_.bytes_saved += bytes.size();
+        } else {
+            stats_.misses++;
+        }
+        if (index.find(key) == index.end()) {
+            lru.push_front(Entry{key, automaton, bytes.size()});
+            index[key] = lru.begin();
+            if (lru.size() > capacity) {
+                index.erase(lru.back().key);
+                lru.pop_back();
+            }
+        }
+        return automaton.to_api();
+    }
+
+    Stats stats() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stats_;
+    }
 
-    std::map<std::set<size_t>, const std::string> pos_to_name = {};
+    static std::string serialize(const std::string &key, const FlatDFA &automaton) {
+        std::string payload;
+        put_string(payload, key);
+        put_string(payload, automaton.alphabet);
+        put_u32(payload, uint32_t(automaton.size()));
+        for (size_t id = 0; id < automaton.size(); id++) {
+            payload += char(automaton.final[id] ? 1 : 0);
+        }
+        for (uint32_t to: automaton.trans) {
+            put_u32(payload, to);
+        }
 
-    void create_state(const std::string &name, const std::set<size_t> set) {
-        name_to_pos[name] = set;
-        marked[name] = false;
+        std::string bytes = "RDFA";
+        put_u32(bytes, format_version);
+        put_u64(bytes, payload.size());
+        put_u64(bytes, checksum(payload));
+        return bytes + payload;
     }
 
-    std::string get_name(const std::set<size_t> &by) {
-        for (const auto &name: name_to_pos) {
-            if (name.second == by) {
-                return name.first;
+    static bool deserialize(const std::string &bytes, const std::string &key, FlatDFA &automaton) {
+        size_t at = 0;
+        uint32_t version, states;
+        uint64_t size, sum;
+        std::string stored_key;
+        if (bytes.compare(0, 4, "RDFA") != 0) {
+            return false;
+        }
+        at = 4;
+        if (!get_u32(bytes, at, version) or version != format_version or
+            !get_u64(bytes, at, size) or !get_u64(bytes, at, sum) or
+            size != bytes.size() - at or checksum(bytes.substr(at)) != sum) {
+            return false;
+        }
+        if (!get_string(bytes, at, stored_key) or stored_key != key or
+            !get_string(bytes, at, automaton.alphabet) or !get_u32(bytes, at, states)) {
+            return false;
+        }
+        const size_t width = automaton.alphabet.size();
+        if (states == 0 or bytes.size() - at != states + size_t(states) * width * 4) {
+            return false;
+        }
+        NameGetter name_getter;
+        automaton.names.clear();
+        automaton.final.assign(states, false);
+        for (size_t id = 0; id < states; id++) {
+            automaton.names.push_back(name_getter.get_name());
+            automaton.final[id] = bytes[at++] != 0;
+        }
+        automaton.trans.assign(size_t(states) * width, FlatDFA::NONE);
+        for (auto &to: automaton.trans) {
+            get_u32(bytes, at, to);
+            if (to != FlatDFA::NONE and to >= states) {
+                return false;
             }
         }
-        return "?";
+        automaton.initial = 0;
+        return true;
     }
 
-    void set_as_marked(const std::string &s) {
-        marked[s] = true;
+private:
+    struct Entry {
+        std::string key;
+        FlatDFA automaton;
+        size_t bytes;
+    };
+
+    static uint64_t checksum(const std::string &data) {
+        uint64_t h = 1469598103934665603ULL;
+        for (char c: data) {
+            h ^= (unsigned char) c;
+            h *= 1099511628211ULL;
+        }
+        return h;
     }
 
-    void set_as_marked(const std::set<size_t> set) {
-        marked[get_name(set)] = true;
+    static void put_u32(std::string &out, uint32_t value) {
+        for (int i = 0; i < 4; i++) {
+            out += char((value >> (8 * i)) & 0xFF);
+        }
+    }
+
+    static void put_u64(std::string &out, uint64_t value) {
+        for (int i = 0; i < 8; i++) {
+            out += char((value >> (8 * i)) & 0xFF);
+        }
+    }
+
+    static void put_string(std::string &out, const std::string &value) {
+        put_u32(out, uint32_t(value.size()));
+        out += value;
+    }
+
+    static bool get_u32(const std::string &in, size_t &at, uint32_t &value) {
+        if (in.size() < at + 4) {
+            return false;
+        }
+        value = 0;
+        for (int i = 0; i < 4; i++) {
+            value |= uint32_t((unsigned char) in[at + i]) << (8 * i);
+        }
+        at += 4;
+        return true;
     }
 
+    static bool get_u64(const std::string &in, size_t &at, uint64_t &value) {
+        if (in.size() < at + 8) {
+            return false;
+        }
+        value = 0;
+        for (int i = 0; i < 8; i++) {
+            value |= uint64_t((unsigned char) in[at + i]) << (8 * i);
+        }
+        at += 8;
+        return true;
+    }
+
+    static bool get_string(const std::string &in, size_t &at, std::string &value) {
+        uint32_t size;
+        if (!get_u32(in, at, size) or in.size() < at + size) {
+            return false;
+        }
+        value = in.substr(at, size);
+        at += size;
+        return true;
+    }
+
+    std::string path_of(const std::string &key) const {
+        char name[32];
+        std::snprintf(name, sizeof(name), "%016llx.dfa", (unsigned long long) checksum(key));
+        return directory + "/" + name;
+    }
+
+    static bool read_file(const std::string &path, std::string &bytes) {
+        std::ifstream in(path, std::ios::binary);
+        if (!in) {
+            return false;
+        }
+        bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        return true;
+    }
+
+    // written next to the target and renamed, so readers never see a partial file
+    static void write_file(const std::string &path, const std::string &bytes) {
+        const std::string tmp = path + ".tmp" + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+        {
+            std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+            if (!out) {
+                return;
+            }
+            out.write(bytes.data(), std::streamsize(bytes.size()));
+            if (!out) {
+                std::remove(tmp.c_str());
+                return;
+            }
+        }
+        if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+            std::remove(tmp.c_str());
+        }
+    }
+
+    const size_t capacity;
+    const std::string directory;
+    std::mutex mutex;
+    std::list<Entry> lru;
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    Stats stats_;
 };
 
-void create_DFA(DFA &dfa, std::set<size_t> &current_set, std::vector<std::set<size_t>> &table_follow_pos,
-                const Alphabet &alphabet, const std::string &s,
-                const Parser &parser, DFAHelper &helper) {
-    // std::cout << dfa.to_string() << std::endl;
-
-    helper.set_as_marked(current_set);
-    for (char sym: alphabet.to_string()) {
-        std::set<size_t> positions = {};
-        for (size_t position_in_string: current_set) {
-            if (sym == parser.converter.convert_to_sym(position_in_string)) {
-                positions.insert(position_in_string);
-            }
-        }
-        std::set<size_t> S{};
-        for (size_t pos: positions) {
-            S = getUnion(S, table_follow_pos[pos]);
-        }
-        if (S.empty()) {
-            continue;
-        }
-        if (!dfa.has_state(helper.get_name(S))) {
-            std::string name = NameGetter::get_name();
-            auto end_pos = table_follow_pos.size() - 1;
-            const bool is_final = S.find(end_pos) != S.end();
-            dfa.create_state(name, is_final);
-            helper.create_state(name, S);
-            // std::cout << helper.get_name(current_set) << std::endl;
-            // std::cout << helper.get_name(S) << std::endl;
-            dfa.set_trans(helper.get_name(current_set), sym, helper.get_name(S));
-
-            create_DFA(dfa, S, table_follow_pos, alphabet, s, parser, helper);
-        } else {
-            dfa.set_trans(helper.get_name(current_set), sym, helper.get_name(S));
+const uint32_t CompileCache::format_version;
+
+// Matcher compiled from a DFA into flat transition tables. Bytes are first mapped to classes
+// (class 0 for bytes outside the alphabet), and each state owns one cache-aligned row of `width`
+// entries, width being a power of two. An entry is the premultiplied row offset of the target,
+// so one step is an add and a load. Rows are ordered dead (row 0), then rejecting, then accepting
+// states, which puts the accept flag in the table layout: a state accepts iff its offset is at
+// least `accept_from`.
+class CompiledDFA {
+public:
+    static const size_t npos = -1;
+    // Cap on the unanchored automaton built for find(); past it find() scans with the anchored one.
+    static const size_t max_search_states = 1 << 16;
+
+    static CompiledDFA compile(const DFA &dfa) {
+        CompiledDFA compiled;
+        const std::string alphabet = dfa.get_alphabet().to_string();
+        for (size_t a = 0; a < alphabet.size(); a++) {
+            compiled.classes[(unsigned char) alphabet[a]] = uint8_t(a + 1);
         }
+        compiled.width = 2;
+        while (compiled.width < alphabet.size() + 1) {
+            compiled.width *= 2;
+        }
+
+        // dense ids: 0 is dead, api states follow in name order
+        const FlatDFA flat = FlatDFA::from_api(dfa);
+        const size_t columns = alphabet.size() + 1;
+        std::vector<uint32_t> dense((flat.size() + 1) * columns, 0);
+        std::vector<bool> accept(flat.size() + 1, false);
+        for (uint32_t i = 0; i < flat.size(); i++) {
+            accept[i + 1] = flat.final[i];
+            for (size_t a = 0; a < alphabet.size(); a++) {
+                const uint32_t to = flat.get_trans(i, a);
+                dense[(i + 1) * columns + a + 1] = to == FlatDFA::NONE ? 0 : to + 1;
+            }
+        }
+        const uint32_t start = flat.initial == FlatDFA::NONE ? 0 : flat.initial + 1;
+
+        compiled.anchored_rows = flat.size() + 1;
+        compiled.anchored = compiled.build_table(dense, accept, columns, false, start,
+                                                 compiled.anchored_start, compiled.anchored_accept_from);
+        compiled.search.reset(new SearchTable);
+        compiled.search->dense = std::move(dense);
+        compiled.search->accept = std::move(accept);
+        compiled.search->columns = columns;
+        compiled.search->start = start;
+        return compiled;
     }
-}
 
-DFA re2dfa(const std::string &s) {
+    // Whole-input match. One chain of lookups is bound by load latency, so inputs of a few
+    // blocks or more are cut into `parts` equal parts scanned in one interleaved loop. The first
+    // part starts from the start state; every other one from a guess, the state that the block
+    // before it leads to from the start state. The state after each block is recorded, and a
+    // part whose guess was wrong is rescanned from the right state only until it meets a recorded
+    // state again, which on most automata happens within a block or two.
+    bool matches(std::string_view text) const {
+        const unsigned char *bytes = reinterpret_cast<const unsigned char *>(text.data());
+        const size_t blocks = text.size() / parts / block;
+        if (blocks < 4) {
+            return run(anchored_start, bytes, text.size()) >= anchored_accept_from;
+        }
+        const uint32_t *table = anchored.get();
+        const size_t part = blocks * block;
+        uint32_t guess[parts] = {anchored_start};
+        for (size_t k = 1; k < parts; k++) {
+            guess[k] = run(anchored_start, bytes + k * part - block, block);
+        }
+        std::vector<uint32_t> after_block(parts * blocks);
+        uint32_t s0 = guess[0];
+        uint32_t s1 = guess[1];
+        uint32_t s2 = guess[2];
+        uint32_t s3 = guess[3];
+        for (size_t b = 0; b < blocks; b++) {
+            const unsigned char *p0 = bytes + b * block;
+            const unsigned char *p1 = p0 + part;
+            const unsigned char *p2 = p1 + part;
+            const unsigned char *p3 = p2 + part;
+            for (size_t i = 0; i < block; i++) {
+                s0 = table[s0 + classes[p0[i]]];
+                s1 = table[s1 + classes[p1[i]]];
+                s2 = table[s2 + classes[p2[i]]];
+                s3 = table[s3 + classes[p3[i]]];
+            }
+            if (s0 == 0) {
+                return false;
+            }
+            after_block[b] = s0;
+            after_block[blocks + b] = s1;
+            after_block[2 * blocks + b] = s2;
+            after_block[3 * blocks + b] = s3;
+        }
 
-    // std::cout << s << std::endl;
-    Parser parser('#' + s, Alphabet(s));
-    Node *right = parser.E();
-    Node *left = new Node('#', parser.converter.get_max_pos());
-    Node *tree = new Node(concat, right, left);
-    fill_nullable(tree);
-    fill_firstpos(tree);
-    fill_lastpos(tree);
+        uint32_t s = s0;
+        const uint32_t guessed_end[parts] = {s0, s1, s2, s3};
+        for (size_t k = 1; k < parts; k++) {
+            if (s == 0) {
+                return false;
+            }
+            if (s == guess[k]) {
+                s = guessed_end[k];
+                continue;
+            }
+            const uint32_t *recorded = after_block.data() + k * blocks;
+            for (size_t b = 0; b < blocks; b++) {
+                s = run(s, bytes + k * part + b * block, block);
+                if (s == recorded[b]) {
+                    s = guessed_end[k];
+                    break;
+                }
+            }
+        }
+        return run(s, bytes + parts * part, text.size() - parts * part) >= anchored_accept_from;
+    }
 
-    std::vector<std::set<size_t>> table_follow_pos;
-    table_follow_pos.assign(parser.converter.get_max_pos() + 1, {});
+    // Offset just past the earliest-ending match anywhere in `text`, or npos if there is none.
+    // The unanchored table is built by the first call, so callers that only match never pay for it.
+    size_t find(std::string_view text) const {
+        std::call_once(search->built, [this] { build_search(*search); });
+        if (!search->table) {
+            return find_slow(text);
+        }
+        const uint32_t *table = search->table.get();
+        const uint32_t accept_from = search->accept_from;
+        uint32_t s = search->encoded_start;
+        if (s >= accept_from) {
+            return 0;
+        }
+        for (size_t i = 0; i < text.size(); i++) {
+            s = table[s + classes[(unsigned char) text[i]]];
+            if (s >= accept_from) {
+                return i + 1;
+            }
+        }
+        return npos;
+    }
 
-    fill_follow_pos(tree, table_follow_pos);
+    // Start offsets of the '\n'-separated lines of `text` on which find() succeeds, in order. The
+    // text is cut at line breaks into `parts` parts that are scanned in one interleaved loop with
+    // the unanchored table, which returns to its start state on every byte outside the alphabet,
+    // so on '\n' too. A line that matches is recorded and the rest of it skipped.
+    std::vector<size_t> matching_lines(std::string_view text) const {
+        std::call_once(search->built, [this] { build_search(*search); });
+        std::vector<size_t> starts;
+        if (!search->table or classes[(unsigned char) '\n'] != 0 or search->encoded_start >= search->accept_from) {
+            for (size_t begin = 0; begin < text.size();) {
+                const size_t end = std::min(text.find('\n', begin), text.size());
+                if (find(text.substr(begin, end - begin)) != npos) {
+                    starts.push_back(begin);
+                }
+                begin = end + 1;
+            }
+            return starts;
+        }
 
-    DFAHelper helper;
-    DFA dfa = DFA(Alphabet(s));
-    std::string name_of_state = NameGetter::get_name();
-    std::set<size_t> first_pos_root = tree->first_pos;
+        const unsigned char *bytes = reinterpret_cast<const unsigned char *>(text.data());
+        const uint32_t *table = search->table.get();
+        const uint32_t start = search->encoded_start;
+        const uint32_t accept_from = search->accept_from;
+        const unsigned char *pos[parts];
+        const unsigned char *end[parts];
+        std::vector<size_t> found[parts];
+        for (size_t k = 0, cut = 0; k < parts; k++) {
+            pos[k] = bytes + cut;
+            cut = k + 1 == parts ? text.size() : std::max(cut, text.size() * (k + 1) / parts);
+            if (cut < text.size()) {
+                cut = std::min(text.find('\n', cut), text.size() - 1) + 1;
+            }
+            end[k] = bytes + cut;
+        }
+        // records the line holding the byte before `after`, which reached an accepting state, and
+        // returns the start of the next line of part k
+        auto matched = [&](size_t k, const unsigned char *after) {
+            const void *before = memrchr(bytes, '\n', size_t(after - bytes));
+            found[k].push_back(before ? size_t(static_cast<const unsigned char *>(before) - bytes) + 1 : 0);
+            const void *newline = std::memchr(after, '\n', size_t(end[k] - after));
+            return newline ? static_cast<const unsigned char *>(newline) + 1 : end[k];
+        };
+
+        // steps all parts until one of them accepts or the shortest reaches its end; the accepting
+        // rows of the search table start at a power of two, so one test on the OR of the states
+        // tells whether any of them accepts (states are size_t, which spares a zero extension per
+        // lookup)
+        const unsigned char *p0 = pos[0];
+        const unsigned char *p1 = pos[1];
+        const unsigned char *p2 = pos[2];
+        const unsigned char *p3 = pos[3];
+        size_t s0 = start;
+        size_t s1 = start;
+        size_t s2 = start;
+        size_t s3 = start;
+        for (;;) {
+            const size_t steps = std::min(std::min(end[0] - p0, end[1] - p1), std::min(end[2] - p2, end[3] - p3));
+            if (steps == 0) {
+                break;
+            }
+            size_t i = 0;
+            while (i < steps) {
+                s0 = table[s0 + classes[p0[i]]];
+                s1 = table[s1 + classes[p1[i]]];
+                s2 = table[s2 + classes[p2[i]]];
+                s3 = table[s3 + classes[p3[i]]];
+                i++;
+                if ((s0 | s1 | s2 | s3) >= accept_from) {
+                    break;
+                }
+            }
+            p0 += i;
+            p1 += i;
+            p2 += i;
+            p3 += i;
+            if ((s0 | s1 | s2 | s3) < accept_from) {
+                continue;
+            }
+            if (s0 >= accept_from) {
+                p0 = matched(0, p0);
+                s0 = start;
+            }
+            if (s1 >= accept_from) {
+                p1 = matched(1, p1);
+                s1 = start;
+            }
+            if (s2 >= accept_from) {
+                p2 = matched(2, p2);
+                s2 = start;
+            }
+            if (s3 >= accept_from) {
+                p3 = matched(3, p3);
+                s3 = start;
+            }
+        }
+        const unsigned char *const reached[parts] = {p0, p1, p2, p3};
+        const size_t reached_state[parts] = {s0, s1, s2, s3};
+        for (size_t k = 0; k < parts; k++) {
+            const unsigned char *p = reached[k];
+            size_t state = reached_state[k];
+            while (p < end[k]) {
+                state = table[state + classes[*p++]];
+                if (state >= accept_from) {
+                    p = matched(k, p);
+                    state = start;
+                }
+            }
+            starts.insert(starts.end(), found[k].begin(), found[k].end());
+        }
+        return starts;
+    }
 
-    auto end_pos = table_follow_pos.size() - 1;
-    const bool is_final = first_pos_root.find(end_pos) != first_pos_root.end();
+    size_t state_count() const {
+        return anchored_rows;
+    }
 
-    dfa.create_state(name_of_state, is_final);
-    helper.create_state(name_of_state, first_pos_root);
-    dfa.set_initial(name_of_state);
+private:
+    // matches() and matching_lines() scan this many parts of the input at once; matches() cuts
+    // its parts into blocks of `block` bytes
+    static const size_t parts = 4;
+    static const size_t block = 64;
+
+    struct AlignedFree {
+        void operator()(uint32_t *p) const {
+            std::free(p);
+        }
+    };
 
+    typedef std::unique_ptr<uint32_t[], AlignedFree> Table;
+
+    // The anchored automaton in dense form until the first find() turns it into `table`
+    // (left empty past max_search_states).
+    struct SearchTable {
+        std::once_flag built;
+        std::vector<uint32_t> dense;
+        std::vector<bool> accept;
+        size_t columns = 0;
+        uint32_t start = 0;
+        Table table;
+        uint32_t encoded_start = 0;
+        uint32_t accept_from = 0;
+    };
 
-    create_DFA(dfa, first_pos_root, table_follow_pos, Alphabet(s), s, parser, helper);
+    CompiledDFA() : width(0), anchored_start(0), anchored_accept_from(0), anchored_rows(0) {
+        std::fill(std::begin(classes), std::end(classes), 0);
+    }
 
-    return dfa;
-}
+    // `dense` has `columns` entries per state, state 0 being dead. Rows are laid out dead,
+    // rejecting, accepting, the accepting ones from a power of two if `align_accept` (unused rows
+    // are left dead); returns the cache-aligned table with premultiplied offsets.
+    Table build_table(const std::vector<uint32_t> &dense, const std::vector<bool> &accept, size_t columns,
+                      bool align_accept, uint32_t start, uint32_t &encoded_start, uint32_t &accept_from) const {
+        const size_t rows = accept.size();
+        std::vector<uint32_t> row_of(rows, 0);
+        uint32_t next_row = 1;
+        for (size_t state = 1; state < rows; state++) {
+            if (!accept[state]) row_of[state] = next_row++;
+        }
+        accept_from = uint32_t(next_row * width);
+        if (align_accept) {
+            accept_from = uint32_t(width);
+            while (accept_from < next_row * width) {
+                accept_from *= 2;
+            }
+            next_row = uint32_t(accept_from / width);
+        }
+        for (size_t state = 1; state < rows; state++) {
+            if (accept[state]) row_of[state] = next_row++;
+        }
+
+        size_t bytes = next_row * width * sizeof(uint32_t);
+        bytes = (bytes + 63) / 64 * 64;
+        Table table(static_cast<uint32_t *>(std::aligned_alloc(64, bytes)));
+        std::fill(table.get(), table.get() + bytes / sizeof(uint32_t), 0);
+        for (size_t state = 1; state < rows; state++) {
+            for (size_t c = 0; c < columns; c++) {
+                const uint32_t to = dense[state * columns + c];
+                if (to != 0) {
+                    table[row_of[state] * width + c] = uint32_t(row_of[to] * width);
+                }
+            }
+        }
+        encoded_start = uint32_t(row_of[start] * width);
+        return table;
+    }
+
+    // Determinises "any prefix, then the DFA" over sets of DFA states.
+    void build_search(SearchTable &target) const {
+        const std::vector<uint32_t> dense = std::move(target.dense);
+        const std::vector<bool> accept = std::move(target.accept);
+        const size_t columns = target.columns;
+        const uint32_t start = target.start;
+        std::map<std::vector<uint32_t>, uint32_t> ids;
+        std::vector<std::vector<uint32_t>> sets = {{}};
+        std::vector<bool> search_accept = {false};
+        std::vector<uint32_t> search_dense(columns, 0);
+        ids[{}] = 0;
+
+        auto intern = [&](std::vector<uint32_t> set) {
+            std::sort(set.begin(), set.end());
+            set.erase(std::unique(set.begin(), set.end()), set.end());
+            auto it = ids.find(set);
+            if (it != ids.end()) {
+                return it->second;
+            }
+            const uint32_t id = uint32_t(sets.size());
+            bool is_accepting = false;
+            for (uint32_t state: set) {
+                is_accepting = is_accepting or accept[state];
+            }
+            ids.emplace(set, id);
+            sets.push_back(set);
+            search_accept.push_back(is_accepting);
+            search_dense.resize(search_dense.size() + columns, 0);
+            return id;
+        };
+
+        const uint32_t search_initial = intern({start});
+        for (uint32_t id = 1; id < sets.size(); id++) {
+            if (sets.size() > max_search_states) {
+                return;
+            }
+            for (size_t c = 0; c < columns; c++) {
+                std::vector<uint32_t> next = {start};
+                for (uint32_t state: sets[id]) {
+                    if (dense[state * columns + c] != 0) {
+                        next.push_back(dense[state * columns + c]);
+                    }
+                }
+                const uint32_t to = intern(next);
+                search_dense[id * columns + c] = to;
+            }
+        }
+        target.table = build_table(search_dense, search_accept, columns, true, search_initial,
+                                   target.encoded_start, target.accept_from);
+    }
+
+    // The anchored automaton run over `n` bytes from the (encoded) state s.
+    uint32_t run(uint32_t s, const unsigned char *bytes, size_t n) const {
+        const uint32_t *table = anchored.get();
+        size_t i = 0;
+        while (i + 4 <= n) {
+            s = table[s + classes[bytes[i]]];
+            s = table[s + classes[bytes[i + 1]]];
+            s = table[s + classes[bytes[i + 2]]];
+            s = table[s + classes[bytes[i + 3]]];
+            i += 4;
+            if (s == 0) {
+                return 0;
+            }
+        }
+        for (; i < n; i++) {
+            s = table[s + classes[bytes[i]]];
+        }
+        return s;
+    }
+
+    size_t find_slow(std::string_view text) const {
+        const uint32_t *table = anchored.get();
+        size_t best = npos;
+        for (size_t begin = 0; begin <= text.size() and begin < best; begin++) {
+            uint32_t s = anchored_start;
+            for (size_t i = begin; i < best; i++) {
+                if (s >= anchored_accept_from) {
+                    best = i;
+                    break;
+                }
+                if (s == 0 or i == text.size()) {
+                    break;
+                }
+                s = table[s + classes[(unsigned char) text[i]]];
+            }
+        }
+        return best;
+    }
+
+    uint8_t classes[256];
+    size_t width;
+    Table anchored;
+    std::unique_ptr<SearchTable> search;
+    uint32_t anchored_start;
+    uint32_t anchored_accept_from;
+    size_t anchored_rows;
+};
+
+const size_t CompiledDFA::npos;
+const size_t CompiledDFA::max_search_states;
+const size_t CompiledDFA::parts;
+const size_t CompiledDFA::block;
+
+// DFA built on demand from a regex's followpos table, in the style of RE2: a state is only
+// determinised when input reaches it, and states live in a cache of at most `max_states`
+// entries (at least 3: the start state, the current state and its successor). When the cache
+// is full it is flushed and rebuilt from the state being matched, so memory stays bounded
+// whatever the size of the full DFA.
+class LazyDFA {
+public:
+    struct Counters {
+        size_t hits = 0;
+        size_t misses = 0;
+        size_t flushes = 0;
+        size_t states_created = 0;
+    };
+
+    explicit LazyDFA(const std::string &regex, size_t init_max_states = 4096) :
+            positions(regex),
+            max_states(std::max<size_t>(init_max_states, 3)),
+            columns(positions.alphabet.size() + 1) {
+        std::fill(std::begin(classes), std::end(classes), 0);
+        for (size_t a = 0; a < positions.alphabet.size(); a++) {
+            classes[(unsigned char) positions.alphabet[a]] = uint8_t(a + 1);
+        }
+        flush();
+        counters_.flushes = 0;
+    }
+
+    // Whole-input match.
+    bool matches(std::string_view text) {
+        uint32_t s = start;
+        for (char ch: text) {
+            const uint8_t c = classes[(unsigned char) ch];
+            if (c == 0) {
+                return false;
+            }
+            uint32_t next = trans[s * columns + c];
+            if (next == unknown) {
+                counters_.misses++;
+                next = compute(s, c);
+                if (next == unknown) {
+                    // the cache was flushed; `s` was re-interned as the last state
+                    s = uint32_t(sets.size() - 1);
+                    next = compute(s, c);
+                }
+            } else {
+                counters_.hits++;
+            }
+            if (next == dead) {
+                return false;
+            }
+            s = next;
+        }
+        return accept[s];
+    }
+
+    // Drops every cached state except the start state.
+    void flush() {
+        ids.clear();
+        sets.clear();
+        trans.clear();
+        accept.clear();
+        counters_.flushes++;
+        start = intern(positions.start_set);
+    }
+
+    const Counters &counters() const {
+        return counters_;
+    }
+
+    size_t cached_states() const {
+        return sets.size();
+    }
+
+private:
+    static const uint32_t unknown = UINT32_MAX;
+    static const uint32_t dead = UINT32_MAX - 1;
+
+    uint32_t intern(const PosSet &set) {
+        auto it = ids.find(set);
+        if (it != ids.end()) {
+            return it->second;
+        }
+        const uint32_t id = uint32_t(sets.size());
+        it = ids.emplace(set, id).first;
+        sets.push_back(&it->first);
+        trans.resize(trans.size() + columns, unknown);
+        accept.push_back(set.contains(positions.end_pos));
+        counters_.states_created++;
+        return id;
+    }
+
+    // Fills trans[s][c]. Returns `unknown` if the cache had to be flushed first, in which
+    // case `s` has been re-interned and the caller retries with its new id.
+    uint32_t compute(uint32_t s, uint8_t c) {
+        PosSet next = positions.empty_set();
+        positions.step(*sets[s], c - 1, next);
+        if (next.empty()) {
+            trans[s * columns + c] = dead;
+            return dead;
+        }
+        if (ids.find(next) == ids.end() and sets.size() >= max_states) {
+            const PosSet current = *sets[s];
+            flush();
+            intern(current);
+            return unknown;
+        }
+        const uint32_t to = intern(next);
+        trans[s * columns + c] = to;
+        return to;
+    }
+
+    const PositionAutomaton positions;
+    const size_t max_states;
+    const size_t columns;
+    uint8_t classes[256];
+
+    std::unordered_map<PosSet, uint32_t, PosSetHash> ids;
+    std::vector<const PosSet *> sets;
+    std::vector<uint32_t> trans;
+    std::vector<bool> accept;
+    uint32_t start = 0;
+    Counters counters_;
+};
+
+const uint32_t LazyDFA::unknown;
+const uint32_t LazyDFA::dead;